@@ -0,0 +1,64 @@
+-- Measures the cost of recording changes in the two layouts of the
+-- pending tables.
+--
+-- Run with "psql -f CaptureBenchmark.sql MyDatabaseName" on a database
+-- where MirrorSetup.sql has been run and no DBMirror.pl is running.
+-- For each layout it reports the WAL bytes and the time per change for
+-- inserting, updating and deleting :rows rows of a mirrored table.
+-- Needs PostgreSQL 10 or later.  Run it a few times and on an otherwise
+-- idle server; the time per change varies far more than the WAL bytes.
+\set rows 10000
+\timing off
+SET client_min_messages = warning;
+
+CREATE TEMP TABLE bench_result (Layout text, Op text, WalBytesPerChange numeric,
+                                MicrosecondsPerChange numeric);
+
+CREATE TABLE dbmirror_bench (id integer PRIMARY KEY, counter integer,
+                             payload text);
+CREATE TRIGGER dbmirror_bench_trig AFTER INSERT OR DELETE OR UPDATE
+    ON dbmirror_bench FOR EACH ROW EXECUTE PROCEDURE recordchange();
+
+CREATE FUNCTION pg_temp.bench(layout text, rows integer) RETURNS void AS $$
+DECLARE
+    startLsn pg_lsn;
+    startTime timestamptz;
+    op text;
+BEGIN
+    FOREACH op IN ARRAY ARRAY['insert', 'update', 'delete'] LOOP
+        startLsn := pg_current_wal_insert_lsn();
+        startTime := clock_timestamp();
+        IF op = 'insert' THEN
+            INSERT INTO dbmirror_bench
+                SELECT g, 0, repeat('x', 100) FROM generate_series(1, rows) g;
+        ELSIF op = 'update' THEN
+            UPDATE dbmirror_bench SET counter = counter + 1;
+        ELSE
+            DELETE FROM dbmirror_bench;
+        END IF;
+        INSERT INTO bench_result VALUES (layout, op,
+            round(pg_wal_lsn_diff(pg_current_wal_insert_lsn(), startLsn) / rows, 1),
+            round(extract(epoch FROM clock_timestamp() - startTime) * 1000000 / rows, 2));
+    END LOOP;
+END
+$$ LANGUAGE plpgsql;
+
+-- Load pending.so and cache the trigger's plans before anything is
+-- measured, so neither is counted against the first layout.
+SET dbmirror.pending_log = off;
+INSERT INTO dbmirror_bench VALUES (0, 0, '');
+DELETE FROM dbmirror_bench;
+SET dbmirror.pending_log = on;
+INSERT INTO dbmirror_bench VALUES (0, 0, '');
+DELETE FROM dbmirror_bench;
+
+SET dbmirror.pending_log = off;
+SELECT pg_temp.bench('Pending+PendingData', :rows);
+SET dbmirror.pending_log = on;
+SELECT pg_temp.bench('PendingLog', :rows);
+
+SELECT * FROM bench_result ORDER BY Op, Layout;
+
+DROP TABLE dbmirror_bench;
+DELETE FROM dbmirror_Pending WHERE TableName = '"public"."dbmirror_bench"';
+DELETE FROM dbmirror_PendingLog WHERE TableName = '"public"."dbmirror_bench"';
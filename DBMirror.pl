@@ -75,14 +75,44 @@ BEGIN {
 use strict;
 use Pg;
 use IO::Handle;
-sub mirrorCommand($$$$$$);
-sub mirrorInsert($$$$$);
-sub mirrorDelete($$$$$);
-sub mirrorUpdate($$$$$);
+use IO::Socket::INET;
+use IO::Select;
+use Time::HiRes qw(time);
+sub mirrorCommand($);
+sub mirrorInsert($);
+sub mirrorDelete($);
+sub mirrorUpdate($);
+sub mirrorSequence($);
+sub readPendingCommands($$);
+sub coalesceCommands(@);
+sub rowIdentity($$);
+sub getPrimaryKeyFields($);
+sub hasImmediateConstraints($);
 sub logErrorMessage($);
 sub setupSlave($);
-sub updateMirrorHostTable($$);
-sub extractData($$);
+sub updateMirrorHostTable($);
+sub mirrorHostTableQuery($);
+sub acknowledgeTransactions($);
+sub upsertClause($$);
+sub largeValueExpression($);
+sub sendLargeValueToSlave($$);
+sub slaveQueryFailed($$);
+sub extractData($$$);
+sub readPendingLogCommands($$);
+sub commitLag($$);
+sub catchUp();
+sub resyncTable($);
+sub resyncFailed($$);
+sub coveredCondition(@);
+sub markMirrored($);
+sub parseSnapshot($);
+sub readCopyLine();
+sub observeStage($$);
+sub setupMetrics();
+sub waitForWork($);
+sub writeMetrics($);
+sub metricsText();
+sub serveMetrics($);
 local $::masterHost;
 local $::masterDb; 
 local $::masterUser; 
@@ -90,6 +120,16 @@ local $::masterPassword;
 local $::errorThreshold=5;
 local $::errorEmailAddr=undef;
 local $::sleepInterval=60;
+local $::transactionBatchSize=1;
+local $::coalesceChanges=0;
+local $::metricsFile;
+local $::metricsPort;
+local $::metricsInterval=10;
+local $::idempotentApply=0;
+local $::ackInterval=1;
+local $::ackBatchSize=1000;
+local $::resyncRatio=0;
+local $::resyncMinChanges=10000;
 
 my %slaveInfoHash;
 local $::slaveInfo = \%slaveInfoHash;
@@ -102,6 +142,41 @@ my $commandCount=0;
 
 my $masterConn;
 
+my %primaryKeyFields;
+my %immediateConstraints;
+
+#The upper bounds of the stage timing histogram buckets in seconds.
+my @stageBuckets = (0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10);
+my %metrics = ("transactionsApplied" => 0,
+	       "rowsFetched" => 0,
+	       "rowsApplied" => 0,
+	       "applyErrors" => 0,
+	       "tablesResynced" => 0,
+	       "rowsResynced" => 0,
+	       "changesSkipped" => 0,
+	       "lagTransactions" => 0,
+	       "lagSeconds" => undef,
+	       "stages" => {});
+my $metricsSocket;
+my $lastMetricsWrite=0;
+my $lastRowsApplied=0;
+my $hasCommitTimestamps=0;
+my $hasStatusTable=0;
+my $hasPendingLog=0;
+my $masterEncoding;
+
+#Used by acknowledgeTransactions when $idempotentApply is set.
+my $ackConn;
+my $ackInFlight;
+my $lastAckTime=0;
+my %unackedSeqIds;
+my %appliedTransIds;
+#The snapshots of the master the tables copied by resyncTable were taken
+#with, keyed by table name.
+my %resyncSnapshots;
+#The tables resyncTable won't copy.  Their changes are always replayed.
+my %noResyncTables;
+
 Main();
 
 sub Main() {
@@ -151,23 +226,108 @@ sub Main() {
 		    $setQuery);
     die;
   }
+
+  #The commit time of the master transactions is only known when
+  #track_commit_timestamp is on.  Without it the lag in seconds is
+  #not reported.
+  my $commitTsResult = $masterConn->exec("SHOW track_commit_timestamp");
+  if($commitTsResult->resultStatus == PGRES_TUPLES_OK &&
+     $commitTsResult->getvalue(0,0) eq 'on') {
+      $hasCommitTimestamps = 1;
+  }
+
+  #Older installations might not have the status table.
+  my $statusTableResult = $masterConn->exec("SELECT to_regclass(" .
+					    "'dbmirror_MirrorHostStatus')");
+  if($statusTableResult->resultStatus == PGRES_TUPLES_OK &&
+     $statusTableResult->getvalue(0,0) ne '') {
+      $hasStatusTable = 1;
+  }
+
+  #Large text values are copied to the slave as the bytes stored on
+  #the master.
+  my $encodingResult = $masterConn->exec("SHOW server_encoding");
+  unless($encodingResult->resultStatus == PGRES_TUPLES_OK) {
+      logErrorMessage($masterConn->errorMessage . "\nSHOW server_encoding");
+      die;
+  }
+  $masterEncoding = $encodingResult->getvalue(0,0);
+
+  #Installations using the single table layout have dbmirror_PendingLog.
+  #Changes are read from both layouts.
+  my $pendingLogResult = $masterConn->exec("SELECT to_regclass(" .
+					   "'dbmirror_PendingLog')");
+  if($pendingLogResult->resultStatus == PGRES_TUPLES_OK &&
+     $pendingLogResult->getvalue(0,0) ne '') {
+      $hasPendingLog = 1;
+  }
+
+  if($::idempotentApply) {
+      #Transactions are acknowledged over their own connection so the
+      #master's bookkeeping doesn't hold up applying the next ones.
+      $ackConn = Pg::connectdb($connectString);
+      unless($ackConn->status == PGRES_CONNECTION_OK) {
+	  logErrorMessage("Can't connect to master database\n" .
+			  $ackConn->errorMessage);
+	  die;
+      }
+      $setResult = $ackConn->exec($setQuery);
+      if($setResult->resultStatus!=PGRES_COMMAND_OK) { 
+	  logErrorMessage($ackConn->errorMessage . "\n" . 
+			  $setQuery);
+	  die;
+      }
+  }
+
+  setupMetrics();
     
   my $firstTime = 1;
   while(1) {
     if($firstTime == 0) {
-      sleep $::sleepInterval; 
+      waitForWork($::sleepInterval); 
     } 
     $firstTime = 0;
     
     setupSlave($::slaveInfo);
    
    
-    
+
+    catchUp();
+    #Changes that are part of a copy made by resyncTable are not fetched.
+    my $coveredCondition = coveredCondition(keys %resyncSnapshots);
     
     #Obtain a list of pending transactions using ordering by our approximation
     #to the commit time.  The commit time approximation is taken to be the
     #SeqId of the last row edit in the transaction.
-    my $pendingTransQuery = "SELECT pd.XID,MAX(SeqId) FROM dbmirror_Pending pd";
+    #Both layouts share the SeqId sequence so the order holds across them.
+    #The third column tells which layouts the transaction is stored in.
+    #A transaction that changed dbmirror.pending_log has changes in both.
+    #The next two columns count its changes and those of them that are
+    #part of a copy.
+    my $pendingTransQuery = "SELECT pd.XID,MAX(pd.SeqId)";
+    if($hasPendingLog) {
+      $pendingTransQuery .= ",CASE WHEN bool_and(pd.InLog) THEN 'log'";
+      $pendingTransQuery .= " WHEN bool_or(pd.InLog) THEN 'both'";
+      $pendingTransQuery .= " ELSE 'pending' END";
+    }
+    else {
+      $pendingTransQuery .= ",'pending'";
+    }
+    $pendingTransQuery .= ",count(*),sum(pd.Covered::int)";
+    if($hasCommitTimestamps) {
+      $pendingTransQuery .= ",extract(epoch from pg_xact_commit_timestamp(";
+      $pendingTransQuery .= "(pd.XID::bigint & 4294967295)::text::xid))";
+    }
+    if($hasPendingLog) {
+      $pendingTransQuery .= " FROM (SELECT XID,SeqId,false AS InLog,";
+      $pendingTransQuery .= " $coveredCondition AS Covered FROM";
+      $pendingTransQuery .= " dbmirror_Pending UNION ALL SELECT XID,SeqId,";
+      $pendingTransQuery .= " true,$coveredCondition FROM dbmirror_PendingLog) pd";
+    }
+    else {
+      $pendingTransQuery .= " FROM (SELECT XID,SeqId,$coveredCondition";
+      $pendingTransQuery .= " AS Covered FROM dbmirror_Pending) pd";
+    }
     $pendingTransQuery .= " LEFT JOIN dbmirror_MirroredTransaction mt INNER JOIN";
     $pendingTransQuery .= " dbmirror_MirrorHost mh ON mt.MirrorHostId = ";
     $pendingTransQuery .= " mh.MirrorHostId AND mh.SlaveName=";
@@ -188,6 +348,11 @@ sub Main() {
     
     my $numPendingTrans = $pendingTransResults->ntuples;
     my $curTransTuple = 0;
+    $metrics{"lagTransactions"} = $numPendingTrans;
+    if($hasCommitTimestamps) {
+      $metrics{"lagSeconds"} = commitLag($pendingTransResults,0);
+    }
+    my %coveredSeqIds;
     
     
     #
@@ -196,8 +361,27 @@ sub Main() {
     # master and sent + committed to the slaves.
     while($curTransTuple < $numPendingTrans) {
       my $XID = $pendingTransResults->getvalue($curTransTuple,0);
-      my $maxSeqId = $pendingTransResults->getvalue($curTransTuple,1);
-      my $seqId;
+      my @batchXIDs;
+      if(exists $appliedTransIds{$XID}) {
+	  #Applied but the master hasn't confirmed it yet.
+	  $curTransTuple = $curTransTuple +1;
+	  next;
+      }
+      my $numCovered = $pendingTransResults->getvalue($curTransTuple,4);
+      if($pendingTransResults->getvalue($curTransTuple,3) == $numCovered) {
+	  #Every change is part of a copy. Nothing is sent to the slave, the
+	  #transaction is only recorded as mirrored along with the others.
+	  $coveredSeqIds{$XID} = $pendingTransResults->getvalue($curTransTuple,1);
+	  $metrics{"changesSkipped"} += $numCovered;
+	  $curTransTuple = $curTransTuple +1;
+	  if(scalar(keys %coveredSeqIds) >= $::ackBatchSize) {
+	      markMirrored(\%coveredSeqIds);
+	      %coveredSeqIds = ();
+	  }
+	  next;
+      }
+      my %lastSeqIds;
+      my @commands;
 
      
       if($::slaveInfo->{'status'} eq 'FileClosed')
@@ -206,32 +390,100 @@ sub Main() {
       }
  
 
+      #
+      # Gather the row edits of up to $transactionBatchSize transactions.
+      # All of them are sent to the slave inside of a single slave
+      # transaction.
+      while($curTransTuple < $numPendingTrans &&
+	    scalar(@batchXIDs) < $::transactionBatchSize) {
+	my $batchXID = $pendingTransResults->getvalue($curTransTuple,0);
+	if(exists $appliedTransIds{$batchXID}) {
+	  $curTransTuple = $curTransTuple +1;
+	  next;
+	}
+	my $numCovered = $pendingTransResults->getvalue($curTransTuple,4);
+	if($pendingTransResults->getvalue($curTransTuple,3) == $numCovered) {
+	  $coveredSeqIds{$batchXID} =
+	    $pendingTransResults->getvalue($curTransTuple,1);
+	  $metrics{"changesSkipped"} += $numCovered;
+	  $curTransTuple = $curTransTuple +1;
+	  next;
+	}
+	$metrics{"changesSkipped"} += $numCovered;
+	my $layouts = $pendingTransResults->getvalue($curTransTuple,2);
+	my @transCommands;
 
-      my $pendingQuery = "SELECT pnd.SeqId,pnd.TableName,";
-      $pendingQuery .= " pnd.Op,pnddata.IsKey, pnddata.Data AS Data ";
-      $pendingQuery .= " FROM dbmirror_Pending pnd, dbmirror_PendingData pnddata ";
-      $pendingQuery .= " WHERE pnd.SeqId = pnddata.SeqId ";
+	foreach my $inPendingLog (0, 1) {
+	  if($layouts eq ($inPendingLog ? 'pending' : 'log')) {
+	    next;
+	  }
+	  my $pendingQuery;
+	  if($inPendingLog) {
+	    $pendingQuery = "SELECT SeqId,TableName,Op,KeyData,Data";
+	    $pendingQuery .= " FROM dbmirror_PendingLog";
+	    $pendingQuery .= " WHERE XID=$batchXID";
+	    if($numCovered > 0) {
+	      $pendingQuery .= " AND NOT $coveredCondition";
+	    }
+	    $pendingQuery .= " ORDER BY SeqId";
+	  }
+	  else {
+	    $pendingQuery = "SELECT pnd.SeqId,pnd.TableName,";
+	    $pendingQuery .= " pnd.Op,pnddata.IsKey, pnddata.Data AS Data ";
+	    $pendingQuery .= " FROM dbmirror_Pending pnd, dbmirror_PendingData pnddata ";
+	    $pendingQuery .= " WHERE pnd.SeqId = pnddata.SeqId ";
      
-      $pendingQuery .= " AND pnd.XID=$XID ORDER BY SeqId, IsKey DESC";
+	    $pendingQuery .= " AND pnd.XID=$batchXID";
+	    if($numCovered > 0) {
+	      $pendingQuery .= " AND NOT $coveredCondition";
+	    }
+	    $pendingQuery .= " ORDER BY SeqId, IsKey DESC";
+	  }
       
       
-      my $pendingResults = $masterConn->exec($pendingQuery);
-      unless($pendingResults->resultStatus==PGRES_TUPLES_OK) {
-	logErrorMessage("Can't query pending table\n" . $masterConn->errorMessage);
-	die;
+	  my $startTime = time;
+	  my $pendingResults = $masterConn->exec($pendingQuery);
+	  unless($pendingResults->resultStatus==PGRES_TUPLES_OK) {
+	    logErrorMessage("Can't query pending table\n" . $masterConn->errorMessage);
+	    die;
+	  }
+	  observeStage("fetch",time - $startTime);
+
+	  $startTime = time;
+	  if($inPendingLog) {
+	    push @transCommands, readPendingLogCommands($batchXID,$pendingResults);
+	  }
+	  else {
+	    push @transCommands, readPendingCommands($batchXID,$pendingResults);
+	  }
+	  observeStage("decode",time - $startTime);
+	  $pendingResults = undef;
+	}
+
+	if($layouts eq 'both') {
+	  #Both layouts share the SeqId sequence.
+	  @transCommands = sort {$a->{"seqId"} <=> $b->{"seqId"}} @transCommands;
+	}
+	push @commands, @transCommands;
+	push @batchXIDs, $batchXID;
+	$lastSeqIds{$batchXID} = $pendingTransResults->getvalue($curTransTuple,1);
+	$curTransTuple = $curTransTuple +1;
+      }
+
+      $metrics{"rowsFetched"} += scalar(@commands);
+      if($::coalesceChanges) {
+	my $startTime = time;
+	@commands = coalesceCommands(@commands);
+	observeStage("decode",time - $startTime);
       }
       
+      my $slaveStartTime = time;
       sendQueryToSlaves($XID,"BEGIN");
+      #Only lasts until the end of the transaction.
+      sendQueryToSlaves($XID,"SET CONSTRAINTS ALL DEFERRED");
 	    
-      my $numPending = $pendingResults->ntuples;
-      my $curTuple = 0;
-      while ($curTuple < $numPending) {
-	$seqId = $pendingResults->getvalue($curTuple,0);
-	my $tableName = $pendingResults->getvalue($curTuple,1);
-	my $op = $pendingResults->getvalue($curTuple,2);
-	$curTuple = mirrorCommand($seqId,$tableName,$op,$XID,
-				  $pendingResults,$curTuple) +1;
-	
+      foreach my $command (@commands) {
+	mirrorCommand($command);
       }
 
       if($::slaveInfo->{'status'} ne 'DBOpen' &&
@@ -240,12 +492,21 @@ sub Main() {
 	  last;
       }
       sendQueryToSlaves(undef,"COMMIT");
+      observeStage("slave",time - $slaveStartTime);
       #Now commit the transaction.
-      updateMirrorHostTable($XID,$seqId);
+      my $bookkeepingStartTime = time;
+      markMirrored(\%lastSeqIds);
+      observeStage("bookkeeping",time - $bookkeepingStartTime);
+
+      $metrics{"transactionsApplied"} += scalar(@batchXIDs);
+      $metrics{"rowsApplied"} += scalar(@commands);
+      $metrics{"lagTransactions"} = $numPendingTrans - $curTransTuple;
+      if($hasCommitTimestamps) {
+	#The lag is the age of the oldest transaction not yet mirrored.
+	$metrics{"lagSeconds"} = commitLag($pendingTransResults,$curTransTuple);
+      }
+      writeMetrics(0);
       
-      $pendingResults = undef;
-      $curTransTuple = $curTransTuple +1;
-
       if($::slaveInfo->{'status'} eq 'FileOpen')
       {
 	  close ($::slaveInfo->{'TransactionFile'});
@@ -265,6 +526,9 @@ sub Main() {
       }
 
     }#while transactions left.
+    if(%coveredSeqIds) {
+      markMirrored(\%coveredSeqIds);
+    }
 	
 	$pendingTransResults = undef;
     
@@ -273,156 +537,453 @@ sub Main() {
 
 
 
-=item mirrorCommand(SeqId,tableName,op,transId,pendingResults,curTuple)
+=item readPendingCommands(transId,pendingResults)
 
-Mirrors a single SQL Command(change to a single row) to the slave.
+Decodes the pending row edits of a single transaction into a list of
+commands.  Each command is a hash reference with the following entries
 
 =over 4
 
-=item * SeqId
-
-The id number of the change to mirror.  This is the
-primary key of the pending table.
+=item * seqId
 
+The id number of the change.  This is the primary key of the pending table.
 
 =item * tableName
 
-The name of the table the transaction takes place on.
+The name of the table (or sequence) the change takes place on.
 
 =item * op
 
-The type of operation this transaction is.  'i' for insert, 'u' for update or
-'d' for delete.
+The type of operation.  'i' for insert, 'u' for update, 'd' for delete
+or 's' for a sequence update.
+
+=item * transId
+
+The Transaction Id of the transaction that this command is part of.
+
+=item * keyValues
+
+A hash of the key fields that identify the row before the change.  Present
+for updates and deletes.
+
+=item * dataValues
+
+A hash of all of the fields of the row after the change.  Present for
+inserts and updates.
+
+=item * sequenceValue
+
+The value the sequence was set to. Present for sequence updates.
+
+=back
+
+=over 4
 
 =item * transId
 
-The Transaction of of the Transaction that this command is part of.
+The Transaction Id of the transaction the row edits belong to.
 
 =item * pendingResults
 
 A Results set structure returned from Pg::execute that contains the 
 join of the Pending and PendingData tables for all of the pending row
-edits in this transaction. 
+edits in this transaction, ordered by SeqId and IsKey descending.  An update
+is made up of two rows, the key row followed by the data row.
+
+=item returns
+
+The list of commands in the order they were made on the master.
+
+=back
+
+=cut
+
+sub readPendingCommands($$) {
+    my $transId = $_[0];
+    my $pendingResults = $_[1];
+    my @commands;
+
+    my $numPending = $pendingResults->ntuples;
+    my $curTuple = 0;
+    while ($curTuple < $numPending) {
+	my %command;
+	$command{"seqId"} = $pendingResults->getvalue($curTuple,0);
+	$command{"tableName"} = $pendingResults->getvalue($curTuple,1);
+	$command{"op"} = $pendingResults->getvalue($curTuple,2);
+	$command{"transId"} = $transId;
+
+	if($command{"op"} eq 'i') {
+	    $command{"dataValues"} = {extractData($pendingResults,$curTuple,4)};
+	}
+	elsif($command{"op"} eq 'd') {
+	    $command{"keyValues"} = {extractData($pendingResults,$curTuple,4)};
+	}
+	elsif($command{"op"} eq 'u') {
+	    #The key row comes first followed by the data row.
+	    $command{"keyValues"} = {extractData($pendingResults,$curTuple,4)};
+	    $curTuple = $curTuple + 1;
+	    $command{"dataValues"} = {extractData($pendingResults,$curTuple,4)};
+	}
+	elsif($command{"op"} eq 's') {
+	    $command{"sequenceValue"} = $pendingResults->getvalue($curTuple,4);
+	}
+	push @commands, \%command;
+	$curTuple = $curTuple + 1;
+    }
+    return @commands;
+}
 
-=item * currentTuple 
 
+=item readPendingLogCommands(transId,pendingResults)
 
-The tuple(or row) number of the pendingRow for the command that is about
-to be edited.   If the command is an update then this points to the row
-with IsKey equal to true.  The next row, curTuple+1 is the contains the
-PendingData with IsKey false for the update.
+Decodes the changes of a single transaction stored in the
+dbmirror_PendingLog table into a list of commands the same way
+readPendingCommands does.
 
+=over 4
+
+=item * transId
+
+The Transaction Id of the transaction the row edits belong to.
+
+=item * pendingResults
+
+A Results set structure with the SeqId, TableName, Op, KeyData and Data
+columns of dbmirror_PendingLog for this transaction, ordered by SeqId.
+There is one row per change.
 
 =item returns
 
+The list of commands in the order they were made on the master.
+
+=back
+
+=cut
+
+sub readPendingLogCommands($$) {
+    my $transId = $_[0];
+    my $pendingResults = $_[1];
+    my @commands;
+
+    for(my $curTuple = 0; $curTuple < $pendingResults->ntuples; $curTuple++) {
+	my %command;
+	$command{"seqId"} = $pendingResults->getvalue($curTuple,0);
+	$command{"tableName"} = $pendingResults->getvalue($curTuple,1);
+	$command{"op"} = $pendingResults->getvalue($curTuple,2);
+	$command{"transId"} = $transId;
+
+	if($command{"op"} eq 's') {
+	    $command{"sequenceValue"} = $pendingResults->getvalue($curTuple,3);
+	}
+	else {
+	    if($command{"op"} eq 'u' || $command{"op"} eq 'd') {
+		$command{"keyValues"} =
+		    {extractData($pendingResults,$curTuple,3)};
+	    }
+	    if($command{"op"} eq 'u' || $command{"op"} eq 'i') {
+		$command{"dataValues"} =
+		    {extractData($pendingResults,$curTuple,4)};
+	    }
+	}
+	push @commands, \%command;
+    }
+    return @commands;
+}
+
+
+=item coalesceCommands(commands)
+
+Merges the commands that change the same row into a single net change.
+The row is identified by the table name and the primary key of the row.
+
+=over 4
+
+=item * insert followed by updates becomes a single insert of the final row.
+
+=item * updates followed by updates become a single update.
+
+=item * update followed by a delete becomes a delete of the original row.
+
+=item * insert followed by a delete is dropped.
+
+=item * delete followed by an insert becomes an update of the original row.
+
+=back
+
+The net change for a row is sent at the position of the first change to
+that row.  Changes to different rows can therefore reach the slave in a
+different order than they were made on the master.  Each slave transaction
+starts with SET CONSTRAINTS ALL DEFERRED, so this is safe for foreign key and
+unique constraints that are DEFERRABLE on the slave.  An update that changes
+the primary key of a row is never merged. It acts as a barrier: commands
+after it are not merged into commands before it, so the slave never sees two
+rows with the same primary key.  Commands to tables with constraints that
+are checked immediately (see hasImmediateConstraints) are barriers as well,
+so they reach the slave in the same order, relative to every other command,
+as they were made on the master.
 
-The tuple number of last tuple for this command.  This might be equal to
-currentTuple or it might be larger (+1 in the case of an Update).
+=over 4
+
+=item * commands
+
+The list of commands as returned by readPendingCommands.
+
+=item returns
 
+The list of net commands.
 
 =back
 
 =cut
 
+sub coalesceCommands(@) {
+    my @netCommands;
+    my %rowCommands;
 
-sub mirrorCommand($$$$$$) {
-    my $seqId = $_[0];
-    my $tableName = $_[1];
-    my $op = $_[2];
-    my $transId = $_[3];
-    my $pendingResults = $_[4];
-    my $currentTuple = $_[5];
+    foreach my $command (@_) {
+	my $op = $command->{"op"};
+	if($op eq 's') {
+	    push @netCommands, $command;
+	    next;
+	}
+	my $tableName = $command->{"tableName"};
+	my $oldIdentity;
+	my $newIdentity;
+	if(defined $command->{"keyValues"}) {
+	    $oldIdentity = rowIdentity($tableName,$command->{"keyValues"});
+	}
+	if(defined $command->{"dataValues"}) {
+	    $newIdentity = rowIdentity($tableName,$command->{"dataValues"});
+	}
+	my $identity = ($op eq 'i') ? $newIdentity : $oldIdentity;
+
+	if(!defined($identity) ||
+	   ($op eq 'u' && (!defined($newIdentity) ||
+			   $oldIdentity ne $newIdentity)) ||
+	   hasImmediateConstraints($tableName)) {
+	    #The primary key is changed (or unknown) or the slave would
+	    #check the change before the end of the transaction. Send the
+	    #command as is and start merging again after it.
+	    push @netCommands, $command;
+	    %rowCommands = ();
+	    next;
+	}
 
+	my $netCommand = $rowCommands{$identity};
+	if(!defined $netCommand) {
+	    $netCommand = {%$command};
+	    push @netCommands, $netCommand;
+	    $rowCommands{$identity} = $netCommand;
+	    next;
+	}
 
-    if($op eq 'i') {
-      $currentTuple = mirrorInsert($seqId,$tableName,$transId,$pendingResults
-			       ,$currentTuple);
-    }
-    if($op eq 'd') {
-      $currentTuple = mirrorDelete($seqId,$tableName,$transId,$pendingResults,
-			       $currentTuple);
-    }
-    if($op eq 'u') {
-      $currentTuple = mirrorUpdate($seqId,$tableName,$transId,$pendingResults,
-		   $currentTuple);
+	my $netOp = $netCommand->{"op"};
+	if($op eq 'i' && $netOp eq 'd') {
+	    $netCommand->{"op"} = 'u';
+	    $netCommand->{"dataValues"} = $command->{"dataValues"};
+	}
+	elsif($op eq 'i' && $netOp eq 'n') {
+	    $netCommand->{"op"} = 'i';
+	    $netCommand->{"dataValues"} = $command->{"dataValues"};
+	}
+	elsif($op eq 'u' && ($netOp eq 'i' || $netOp eq 'u')) {
+	    $netCommand->{"dataValues"} = $command->{"dataValues"};
+	}
+	elsif($op eq 'd' && $netOp eq 'i') {
+	    #Nothing to send, but a later insert of the same key
+	    #must still be merged into this command.
+	    $netCommand->{"op"} = 'n';
+	    delete $netCommand->{"dataValues"};
+	}
+	elsif($op eq 'd' && $netOp eq 'u') {
+	    $netCommand->{"op"} = 'd';
+	    delete $netCommand->{"dataValues"};
+	}
+	else {
+	    #The command can't apply to the row as we know it
+	    #(ie. an insert of an existing key). Don't second guess
+	    #it and let the slave report the error.
+	    push @netCommands, $command;
+	    %rowCommands = ();
+	    next;
+	}
+	$netCommand->{"seqId"} = $command->{"seqId"};
     }
-    if($op eq 's')  {
-	$currentTuple = mirrorSequence($seqId,$tableName,$transId,$pendingResults,
-				       $currentTuple);
+
+    return grep { $_->{"op"} ne 'n' } @netCommands;
+}
+
+
+=item rowIdentity(tableName,values)
+
+Returns a string that identifies the row with the primary key contained in
+values, or undef if values does not contain the entire primary key of
+tableName.
+
+=cut
+
+sub rowIdentity($$) {
+    my $tableName = $_[0];
+    my $values = $_[1];
+    my $identity = $tableName;
+
+    foreach my $keyField (getPrimaryKeyFields($tableName)) {
+	unless(exists $values->{$keyField}) {
+	    return undef;
+	}
+	my $value = $values->{$keyField};
+	$identity .= defined($value) ? "\0'" . $value : "\0";
     }
-    $commandCount = $commandCount +1;
-    if($commandCount % 100 == 0) {
-    #  print "Sent 100 commmands on SeqId $seqId \n";
-    #  flush STDOUT;
+    return $identity;
+}
+
+
+=item getPrimaryKeyFields(tableName)
+
+Returns the names of the primary key fields of a table on the master.
+The result is cached for the lifetime of the script.
+
+=cut
+
+sub getPrimaryKeyFields($) {
+    my $tableName = $_[0];
+
+    unless(defined $primaryKeyFields{$tableName}) {
+	my $quotedName = $tableName;
+	$quotedName =~ s/'/''/g;
+	my $keyQuery = "SELECT a.attname FROM pg_index i, pg_attribute a";
+	$keyQuery .= " WHERE i.indrelid = '$quotedName'::regclass";
+	$keyQuery .= " AND i.indisprimary AND a.attrelid = i.indrelid";
+	$keyQuery .= " AND a.attnum = ANY (i.indkey) ORDER BY a.attnum";
+	my $keyResult = $masterConn->exec($keyQuery);
+	unless($keyResult->resultStatus == PGRES_TUPLES_OK) {
+	    logErrorMessage($masterConn->errorMessage . "\n" . $keyQuery);
+	    die;
+	}
+	my @keyFields;
+	for(my $curTuple = 0; $curTuple < $keyResult->ntuples; $curTuple++) {
+	    push @keyFields, $keyResult->getvalue($curTuple,0);
+	}
+	$primaryKeyFields{$tableName} = \@keyFields;
     }
-    return $currentTuple
-  }
+    return @{$primaryKeyFields{$tableName}};
+}
 
 
-=item mirrorInsert(transId,tableName,transId,pendingResults,currentTuple)
+=item hasImmediateConstraints(tableName)
 
-Mirrors an INSERT operation to the slave database.  A new row is placed
-in the slave database containing the primary key from pendingKeys along with
-the data fields contained in the row identified by sourceOid.
+Returns true if a table has a constraint that the slave checks as soon as
+a row is changed instead of at the end of the transaction: a foreign key
+from or to the table that is not DEFERRABLE, a unique constraint or unique
+index other than the primary key that is not DEFERRABLE or an exclusion
+constraint that is not DEFERRABLE.  The constraints of the slave are used
+when DBMirror.pl talks to a slave database, otherwise those of the master.
+The result is cached for the lifetime of the script.
 
-=over 4
+=cut
 
-=item * transId
+sub hasImmediateConstraints($) {
+    my $tableName = $_[0];
 
-The sequence id of the INSERT operation being mirrored. This is the primary
-key of the pending table.
+    unless(defined $immediateConstraints{$tableName}) {
+	my $conn = $masterConn;
+	if($::slaveInfo->{"status"} eq 'DBOpen') {
+	    $conn = $::slaveInfo->{"slaveConn"};
+	}
+	my $quotedName = $tableName;
+	$quotedName =~ s/'/''/g;
+	my $constraintQuery = "SELECT EXISTS (SELECT 1 FROM pg_constraint c";
+	$constraintQuery .= " WHERE NOT c.condeferrable AND (c.contype IN ('f','x')";
+	$constraintQuery .= " AND c.conrelid = to_regclass('$quotedName')";
+	$constraintQuery .= " OR c.contype = 'f'";
+	$constraintQuery .= " AND c.confrelid = to_regclass('$quotedName')))";
+	$constraintQuery .= " OR EXISTS (SELECT 1 FROM pg_index i";
+	$constraintQuery .= " WHERE i.indrelid = to_regclass('$quotedName')";
+	$constraintQuery .= " AND i.indisunique AND i.indimmediate";
+	$constraintQuery .= " AND NOT i.indisprimary)";
+	my $constraintResult = $conn->exec($constraintQuery);
+	unless($constraintResult->resultStatus == PGRES_TUPLES_OK) {
+	    logErrorMessage($conn->errorMessage . "\n" . $constraintQuery);
+	    die;
+	}
+	$immediateConstraints{$tableName} =
+	    $constraintResult->getvalue(0,0) eq 't' ? 1 : 0;
+    }
+    return $immediateConstraints{$tableName};
+}
 
-=item * tableName
 
+=item mirrorCommand(command)
 
-The name of the table the transaction takes place on.
+Mirrors a single SQL Command(change to a single row) to the slave.
 
-=item * sourceOid
+=over 4
 
-The OID of the row in the master database for which this transaction effects.
-If the transaction is a delete then the operation is not valid.
+=item * command
 
-=item * transId 
+The command to mirror as returned by readPendingCommands.
 
-The Transaction Id of transaction that this insert is part of.
+=back
 
+=cut
 
 
-=item * pendingResults
+sub mirrorCommand($) {
+    my $command = $_[0];
+    my $op = $command->{"op"};
 
-A Results set structure returned from Pg::execute that contains the 
-join of the Pending and PendingData tables for all of the pending row
-edits in this transaction. 
+    if(defined $command->{"dataValues"}) {
+      foreach my $value (values %{$command->{"dataValues"}}) {
+	if(ref $value) {
+	  sendLargeValueToSlave($command->{"transId"},$value->{"largeValue"});
+	}
+      }
+    }
+
+    if($op eq 'i') {
+      mirrorInsert($command);
+    }
+    if($op eq 'd') {
+      mirrorDelete($command);
+    }
+    if($op eq 'u') {
+      mirrorUpdate($command);
+    }
+    if($op eq 's')  {
+	mirrorSequence($command);
+    }
+    $commandCount = $commandCount +1;
+    if($commandCount % 100 == 0) {
+    #  print "Sent 100 commmands on SeqId $command->{seqId} \n";
+    #  flush STDOUT;
+    }
+  }
 
-=item * currentTuple 
 
+=item mirrorInsert(command)
 
-The tuple(or row) number of the pendingRow for the command that is about
-to be edited.   In the case of an insert this should point to the one 
-row for the row edit.
+Mirrors an INSERT operation to the slave database.  A new row is placed
+in the slave database containing the data fields of the command.
 
-=item returns
+=over 4
 
-The tuple number of the last tuple for the row edit.  This should be 
-currentTuple.
+=item * command
 
+The insert command. Its dataValues contain every field of the new row.
 
 =back
 
 =cut
 
 
-sub mirrorInsert($$$$$) {
-    my $seqId = $_[0];
-    my $tableName = $_[1];
-    my $transId = $_[2];
-    my $pendingResults = $_[3];
-    my $currentTuple = $_[4];
-    my $counter;
+sub mirrorInsert($) {
+    my $command = $_[0];
+    my $tableName = $command->{"tableName"};
+    my $transId = $command->{"transId"};
     my $column;
 
     my $firstIteration=1;
-    my %recordValues = extractData($pendingResults,$currentTuple);
+    my %recordValues = %{$command->{"dataValues"}};
 
         
     #Now build the insert query.
@@ -434,7 +995,10 @@ sub mirrorInsert($$$$$) {
 	    $valuesQuery .= " ,";
 	}
       $insertQuery .= "\"$column\"";
-      if(defined $recordValues{$column}) {
+      if(ref $recordValues{$column}) {
+	$valuesQuery .= largeValueExpression($recordValues{$column});
+      }
+      elsif(defined $recordValues{$column}) {
 	my $quotedValue = $recordValues{$column};
 	$quotedValue =~ s/\\/\\\\/g;
 	$quotedValue =~ s/'/''/g;
@@ -446,65 +1010,75 @@ sub mirrorInsert($$$$$) {
 	$firstIteration=0;
     }
     $valuesQuery .= ")";
+    if($::idempotentApply) {
+	$valuesQuery .= upsertClause($tableName,\%recordValues);
+    }
     sendQueryToSlaves($transId,$insertQuery . $valuesQuery);
-    return $currentTuple;
 }
 
-=item mirrorDelete(SeqId,tableName,transId,pendingResult,currentTuple)
-
-Deletes a single row from the slave database.  The row is identified by the
-primary key for the transaction in the pendingKeys table.
-
-=over 4
-
-=item * SeqId
-
-The Sequence id for this delete request.
-
-=item * tableName
-
-The name of the table to delete the row from.
 
-=item * transId 
-
-The Transaction Id of the transaction that this command is part of.
+=item upsertClause(tableName,recordValues)
 
+Returns the ON CONFLICT clause that turns an INSERT of recordValues into
+tableName into an update of the existing row with the same primary key.
+Returns an empty string if the primary key of tableName is not known.
 
+=cut
 
-=item * pendingResults
+sub upsertClause($$) {
+    my $tableName = $_[0];
+    my $recordValues = $_[1];
 
-A Results set structure returned from Pg::execute that contains the 
-join of the Pending and PendingData tables for all of the pending row
-edits in this transaction. 
+    my @keyFields = getPrimaryKeyFields($tableName);
+    if($#keyFields < 0) {
+	return "";
+    }
+    my %isKeyField = map { $_ => 1 } @keyFields;
+    my @setFields = grep { !$isKeyField{$_} } keys %$recordValues;
 
-=item * currentTuple 
+    my $upsertQuery = " ON CONFLICT (" . join(',',map { "\"$_\"" } @keyFields)
+	. ")";
+    if($#setFields < 0) {
+	return $upsertQuery . " DO NOTHING";
+    }
+    return $upsertQuery . " DO UPDATE SET "
+	. join(', ',map { "\"$_\"=EXCLUDED.\"$_\"" } @setFields);
+}
 
+=item mirrorDelete(command)
 
-The tuple(or row) number of the pendingRow for the command that is about
-to be edited.   In the case of a  delete this should point to the one 
-row for the row edit.
+Deletes a single row from the slave database.  The row is identified by the
+key fields of the command.
 
-=item returns
+=over 4
 
-The tuple number of the last tuple for the row edit.  This should be 
-currentTuple.
+=item * command
 
+The delete command.  Its keyValues identify the row to delete.  If
+$idempotentApply is set only the primary key is used.
 
 =back
 
 =cut
 
 
-sub mirrorDelete($$$$$) {
-    my $seqId = $_[0];
-    my $tableName = $_[1];
-    my $transId = $_[2];
-    my $pendingResult = $_[3];
-    my $currentTuple = $_[4];
+sub mirrorDelete($) {
+    my $command = $_[0];
+    my $tableName = $command->{"tableName"};
+    my $transId = $command->{"transId"};
     my %dataHash;
     my $currentField;
     my $firstField=1;
-    %dataHash = extractData($pendingResult,$currentTuple);
+    %dataHash = %{$command->{"keyValues"}};
+
+    if($::idempotentApply) {
+	#The other key fields (ie. foreign keys logged by verbose triggers)
+	#might not match a row that an earlier replay already changed.
+	my @keyFields = getPrimaryKeyFields($tableName);
+	if($#keyFields >= 0 && !grep { !exists $dataHash{$_} } @keyFields) {
+	    %dataHash = map { $_ => $dataHash{$_} } @keyFields;
+	}
+    }
 
     my $counter=0;
     my $deleteQuery = "DELETE FROM $tableName WHERE ";
@@ -527,11 +1101,10 @@ sub mirrorDelete($$$$$) {
       $firstField=0;
     }
     sendQueryToSlaves($transId,$deleteQuery);
-    return $currentTuple;
 }
 
 
-=item mirrorUpdate(seqId,tableName,transId,pendingResult,currentTuple)
+=item mirrorUpdate(command)
 
 Mirrors over an edit request to a single row of the database.
 The primary key from before the edit is used to determine which row in the
@@ -544,52 +1117,26 @@ to the current values.
 Data integrity is maintained because the mirroring is performed in an 
 SQL transcation so either all pending changes are made or none are.
 
-=over 4
-
-=item * seqId 
-
-The Sequence id of the update.
-
-=item * tableName
-
-The name of the table to perform the update on.
-
-=item * transId
-
-The transaction Id for the transaction that this command is part of.
-
-
-=item * pendingResults
-
-A Results set structure returned from Pg::execute that contains the 
-join of the Pending and PendingData tables for all of the pending row
-edits in this transaction. 
-
-=item * currentTuple 
-
+If $idempotentApply is set the row is instead written with an upsert of
+its new contents, after deleting the old row if the primary key changed.
+Applying the update again then leaves the slave unchanged.
 
-The tuple(or row) number of the pendingRow for the command that is about
-to be edited.   In the case of a  delete this should point to the one 
-row for the row edit.
-
-=item returns
+=over 4
 
-The tuple number of the last tuple for the row edit.  This should be 
-currentTuple +1.  Which points to the non key row of the update.
+=item * command
 
+The update command.  Its keyValues contain the key fields before the
+update and its dataValues contain the entire row after the update.
 
 =back
 
 =cut
 
-sub mirrorUpdate($$$$$) {
-    my $seqId = $_[0];
-    my $tableName = $_[1];
-    my $transId = $_[2];
-    my $pendingResult = $_[3];
-    my $currentTuple = $_[4];
+sub mirrorUpdate($) {
+    my $command = $_[0];
+    my $tableName = $command->{"tableName"};
+    my $transId = $command->{"transId"};
   
-    my $counter;
     my $quotedValue;
     my $updateQuery = "UPDATE $tableName SET ";
     my $currentField;
@@ -598,14 +1145,24 @@ sub mirrorUpdate($$$$$) {
     my %dataValueHash;
     my $firstIteration=1;
 
+    if($::idempotentApply && getPrimaryKeyFields($tableName)) {
+	my $oldIdentity = rowIdentity($tableName,$command->{"keyValues"});
+	my $newIdentity = rowIdentity($tableName,$command->{"dataValues"});
+	if(!defined($oldIdentity) || $oldIdentity ne $newIdentity) {
+	    mirrorDelete($command);
+	}
+	mirrorInsert($command);
+	return;
+    }
+
     #Extract the Key values. This row contains the values of the
     # key fields before the update occours(the WHERE clause)
-    %keyValueHash = extractData($pendingResult,$currentTuple);
+    %keyValueHash = %{$command->{"keyValues"}};
 
 
     #Extract the data values.  This is a SET clause that contains 
     #values for the entire row AFTER the update.    
-    %dataValueHash = extractData($pendingResult,$currentTuple+1);
+    %dataValueHash = %{$command->{"dataValues"}};
 
     $firstIteration=1;
     foreach $currentField (keys (%dataValueHash)) {
@@ -614,7 +1171,10 @@ sub mirrorUpdate($$$$$) {
       }
       $updateQuery .= " \"$currentField\"=";
       my $currentValue = $dataValueHash{$currentField};
-      if(defined $currentValue ) {
+      if(ref $currentValue) {
+	$updateQuery .= largeValueExpression($currentValue);
+      }
+      elsif(defined $currentValue ) {
 	$quotedValue = $currentValue;
 	$quotedValue =~ s/\\/\\\\/g;
 	$quotedValue =~ s/'/''/g;
@@ -648,33 +1208,567 @@ sub mirrorUpdate($$$$$) {
       $firstIteration=0;
     }
     sendQueryToSlaves($transId,$updateQuery);
-    return $currentTuple+1;
 }
 
 
-sub mirrorSequence($$$$$) {
-    my $seqId = $_[0];
-    my $sequenceName = $_[1];
-    my $transId = $_[2];
-    my $pendingResult = $_[3];
-    my $currentTuple = $_[4];
+sub mirrorSequence($) {
+    my $command = $_[0];
+    my $sequenceName = $command->{"tableName"};
+    my $transId = $command->{"transId"};
  
 
     my $query;
-    my $sequenceValue = $pendingResult->getvalue($currentTuple,4);
+    my $sequenceValue = $command->{"sequenceValue"};
     $query = sprintf("select setval('%s',%s)",$sequenceName,$sequenceValue);
 
     sendQueryToSlaves($transId,$query);
-    return $currentTuple;
 
 }
 
-=item sendQueryToSlaves(seqId,sqlQuery)
-
-Sends an SQL query to the slave.
+=item largeValueExpression(value)
 
+Returns the SQL expression that reassembles a value stored in
+dbmirror_LargeValue on the slave.  value is the reference returned by
+extractData.  Text values are stored in the encoding of the master and
+converted to the encoding of the slave.
 
-=over 4
+=cut
+
+sub largeValueExpression($) {
+    my $value = $_[0];
+    my $expression = "(SELECT string_agg(Data,''::bytea ORDER BY ChunkNo)"
+	. " FROM dbmirror_LargeValue WHERE Hash='" . $value->{"largeValue"} . "')";
+    if($value->{"binary"}) {
+	return $expression;
+    }
+    return "convert_from($expression,'$masterEncoding')";
+}
+
+
+=item sendLargeValueToSlave(transId,hash)
+
+Copies the chunks of the value with the given hash from
+dbmirror_LargeValue on the master to dbmirror_LargeValue on the slave,
+unless the slave already has them.  The chunks are sent with COPY one chunk
+per line.  The copy happens inside of the current slave transaction so it
+is undone along with the transaction if that fails.
+
+=over 4
+
+=item * transId
+
+The Transaction Id of the command that refers to the value.
+
+=item * hash
+
+The hash of the value.
+
+=back
+
+=cut
+
+sub sendLargeValueToSlave($$) {
+    my $transId = $_[0];
+    my $hash = $_[1];
+
+    if($::slaveInfo->{"status"} eq 'DBOpen') {
+	my $slaveConn = $::slaveInfo->{"slaveConn"};
+	my $existsResult = $slaveConn->exec("SELECT 1 FROM dbmirror_LargeValue"
+					    . " WHERE Hash='$hash' AND ChunkNo=0");
+	if($existsResult->resultStatus == PGRES_TUPLES_OK &&
+	   $existsResult->ntuples == 1) {
+	    return;
+	}
+    }
+    elsif($::slaveInfo->{"status"} ne 'FileOpen') {
+	return;
+    }
+
+    my $copyQuery = "COPY (SELECT Hash,ChunkNo,Data FROM dbmirror_LargeValue";
+    $copyQuery .= " WHERE Hash='$hash' ORDER BY ChunkNo) TO STDOUT";
+    my $copyResult = $masterConn->exec($copyQuery);
+    unless($copyResult->resultStatus == PGRES_COPY_OUT) {
+	logErrorMessage($masterConn->errorMessage . "\n" . $copyQuery);
+	die;
+    }
+
+    my $copyIn = "COPY dbmirror_LargeValue (Hash,ChunkNo,Data) FROM STDIN";
+    my $slaveConn;
+    if($::slaveInfo->{"status"} eq 'DBOpen') {
+	$slaveConn = $::slaveInfo->{"slaveConn"};
+	my $copyInResult = $slaveConn->exec($copyIn);
+	unless($copyInResult->resultStatus == PGRES_COPY_IN) {
+	    slaveQueryFailed($transId,$copyIn);
+	    $slaveConn = undef;
+	}
+    }
+    else {
+	#The file can't check what the slave has. Replace the value instead.
+	my $xfile = $::slaveInfo->{'TransactionFile'};
+	print $xfile "DELETE FROM dbmirror_LargeValue WHERE Hash='$hash';\n";
+	print $xfile $copyIn . ";\n";
+    }
+
+    while(defined(my $line = readCopyLine())) {
+	if(defined $slaveConn) {
+	    $slaveConn->putline($line . "\n");
+	}
+	elsif($::slaveInfo->{"status"} eq 'FileOpen') {
+	    my $xfile = $::slaveInfo->{'TransactionFile'};
+	    print $xfile $line . "\n";
+	}
+    }
+    $masterConn->endcopy;
+
+    if(defined $slaveConn) {
+	$slaveConn->putline("\\.\n");
+	if($slaveConn->endcopy != 0) {
+	    slaveQueryFailed($transId,$copyIn);
+	}
+    }
+    elsif($::slaveInfo->{"status"} eq 'FileOpen') {
+	my $xfile = $::slaveInfo->{'TransactionFile'};
+	print $xfile "\\.\n";
+    }
+}
+
+
+=item readCopyLine()
+
+Reads the next line of the COPY TO STDOUT running on the master.
+
+=over 4
+
+=item returns
+
+The line without its newline or undef at the end of the data.
+
+=back
+
+=cut
+
+sub readCopyLine() {
+    my $line = '';
+    my $buffer;
+    my $ret;
+    do {
+	$ret = $masterConn->getline($buffer,65536);
+	$line .= $buffer if $ret != -1;
+    } while($ret == 1);
+    if($ret == -1 || $line eq "\\.") {
+	return undef;
+    }
+    return $line;
+}
+
+
+=item catchUp()
+
+Copies the tables that are cheaper to copy to the slave than to bring up
+to date by replaying their pending changes, which happens after the slave
+has been unavailable for a while.  The cost of replaying is estimated as
+the number of pending changes to the table and the cost of copying as the
+number of rows in the table (pg_class.reltuples on the master).  A table
+is copied with resyncTable when it has at least $resyncMinChanges pending
+changes and more than $resyncRatio pending changes per row.
+
+It also forgets the copies whose obsolete changes have all been skipped.
+The copies are remembered in the dbmirror_Resync table of the slave.
+Nothing is copied when the changes are written to transaction files.
+
+=cut
+
+sub catchUp() {
+    unless($::slaveInfo->{"status"} eq 'DBOpen') {
+	return;
+    }
+    my $slaveConn = $::slaveInfo->{"slaveConn"};
+    my $resyncTableResult = $slaveConn->exec("SELECT to_regclass(" .
+					     "'dbmirror_Resync')");
+    unless($resyncTableResult->resultStatus == PGRES_TUPLES_OK &&
+	   $resyncTableResult->getvalue(0,0) ne '') {
+	if($::resyncRatio > 0) {
+	    logErrorMessage("The slave has no dbmirror_Resync table" .
+			    " (see SlaveSetup.sql). Tables are not resynced.");
+	    $::resyncRatio = 0;
+	}
+	return;
+    }
+
+    my $resyncResult = $slaveConn->exec("SELECT TableName,Snapshot" .
+					" FROM dbmirror_Resync");
+    unless($resyncResult->resultStatus == PGRES_TUPLES_OK) {
+	slaveQueryFailed(undef,"SELECT TableName,Snapshot FROM dbmirror_Resync");
+	return;
+    }
+    %resyncSnapshots = ();
+    for(my $row = 0; $row < $resyncResult->ntuples; $row++) {
+	$resyncSnapshots{$resyncResult->getvalue($row,0)} =
+	    parseSnapshot($resyncResult->getvalue($row,1));
+    }
+
+    #The changes a copy made obsolete were committed before the copy was
+    #taken.  Once none of them is waiting to be mirrored the copy is up to
+    #date and normal replay takes over.
+    my $pendingQuery = "SELECT XID,TableName FROM dbmirror_Pending";
+    if($hasPendingLog) {
+	$pendingQuery .= " UNION ALL SELECT XID,TableName FROM dbmirror_PendingLog";
+    }
+    foreach my $tableName (keys %resyncSnapshots) {
+	my $waitingQuery = "SELECT 1 FROM ($pendingQuery) pd WHERE ";
+	$waitingQuery .= coveredCondition($tableName);
+	$waitingQuery .= " AND NOT EXISTS (SELECT 1 FROM";
+	$waitingQuery .= " dbmirror_MirroredTransaction mt WHERE mt.XID=pd.XID";
+	$waitingQuery .= " AND mt.MirrorHostId=" . $::slaveInfo->{"MirrorHostId"};
+	$waitingQuery .= ") LIMIT 1";
+	my $waitingResult = $masterConn->exec($waitingQuery);
+	unless($waitingResult->resultStatus == PGRES_TUPLES_OK) {
+	    logErrorMessage("Can't query pending table\n" .
+			    $masterConn->errorMessage);
+	    die;
+	}
+	if($waitingResult->ntuples == 0) {
+	    my $quotedName = $tableName;
+	    $quotedName =~ s/'/''/g;
+	    sendQueryToSlaves(undef,"DELETE FROM dbmirror_Resync WHERE" .
+			      " TableName='$quotedName'");
+	    delete $resyncSnapshots{$tableName};
+	}
+    }
+
+    unless($::resyncRatio > 0) {
+	return;
+    }
+    my $backlogQuery = "SELECT pd.TableName,count(*),c.reltuples";
+    $backlogQuery .= " FROM (SELECT XID,TableName FROM dbmirror_Pending";
+    $backlogQuery .= " WHERE Op<>'s'";
+    if($hasPendingLog) {
+	$backlogQuery .= " UNION ALL SELECT XID,TableName";
+	$backlogQuery .= " FROM dbmirror_PendingLog WHERE Op<>'s'";
+    }
+    $backlogQuery .= ") pd LEFT JOIN dbmirror_MirroredTransaction mt";
+    $backlogQuery .= " ON pd.XID=mt.XID AND mt.MirrorHostId=";
+    $backlogQuery .= $::slaveInfo->{"MirrorHostId"};
+    $backlogQuery .= " INNER JOIN pg_class c";
+    $backlogQuery .= " ON c.oid=to_regclass(pd.TableName::text)";
+    $backlogQuery .= " WHERE mt.XID IS NULL GROUP BY pd.TableName,c.reltuples";
+    $backlogQuery .= " HAVING count(*) >= $::resyncMinChanges";
+    my $backlogResult = $masterConn->exec($backlogQuery);
+    unless($backlogResult->resultStatus == PGRES_TUPLES_OK) {
+	logErrorMessage("Can't query pending table\n" .
+			$masterConn->errorMessage);
+	die;
+    }
+    for(my $row = 0; $row < $backlogResult->ntuples; $row++) {
+	my $tableName = $backlogResult->getvalue($row,0);
+	my $numChanges = $backlogResult->getvalue($row,1);
+	my $numRows = $backlogResult->getvalue($row,2);
+	if($numRows < 1) {
+	    $numRows = 1;
+	}
+	if(exists $resyncSnapshots{$tableName} ||
+	   exists $noResyncTables{$tableName} ||
+	   $numChanges <= $::resyncRatio * $numRows) {
+	    next;
+	}
+	resyncTable($tableName);
+	if($::slaveInfo->{"status"} ne 'DBOpen') {
+	    return;
+	}
+    }
+}
+
+
+=item resyncTable(tableName)
+
+Replaces the contents of a table on the slave with a copy of the table on
+the master.  The copy is read with COPY in a REPEATABLE READ transaction so
+it holds exactly the changes of the transactions that had committed when
+its snapshot was taken.  The snapshot is stored in dbmirror_Resync in the
+same slave transaction as the copy.  The pending changes to the table that
+are part of these transactions are then skipped (see coveredCondition).
+
+The copied table is ahead of the other tables until the skipped changes
+have been passed.  Replaying the changes to a table that refers to it, or
+that it refers to, could then violate a foreign key (ie. an insert of a
+row referring to a row whose insert was skipped).  Tables that have a
+foreign key on the slave, in either direction, are therefore never copied
+and are added to noResyncTables.
+
+=over 4
+
+=item * tableName
+
+The name of the table, as stored in the pending tables.
+
+=back
+
+=cut
+
+sub resyncTable($) {
+    my $tableName = $_[0];
+    my $slaveConn = $::slaveInfo->{"slaveConn"};
+    my $quotedName = $tableName;
+    $quotedName =~ s/'/''/g;
+    my $startTime = time;
+
+    my $foreignKeyQuery = "SELECT 1 FROM pg_constraint WHERE contype='f'";
+    $foreignKeyQuery .= " AND (conrelid=to_regclass('$quotedName')";
+    $foreignKeyQuery .= " OR confrelid=to_regclass('$quotedName'))";
+    my $foreignKeyResult = $slaveConn->exec($foreignKeyQuery);
+    unless($foreignKeyResult->resultStatus == PGRES_TUPLES_OK) {
+	resyncFailed($tableName,$foreignKeyQuery);
+	return;
+    }
+    if($foreignKeyResult->ntuples > 0) {
+	logErrorMessage("$tableName has foreign keys on the slave." .
+			" Its changes are replayed instead of copying it.");
+	$noResyncTables{$tableName} = 1;
+	return;
+    }
+
+    my $beginResult = $masterConn->exec("BEGIN ISOLATION LEVEL REPEATABLE READ"
+					. " READ ONLY");
+    unless($beginResult->resultStatus == PGRES_COMMAND_OK) {
+	logErrorMessage($masterConn->errorMessage);
+	die;
+    }
+    #The snapshot of the transaction is taken by its first query.
+    my $columnsQuery = "SELECT txid_current_snapshot(),";
+    $columnsQuery .= "string_agg(quote_ident(attname),',' ORDER BY attnum)";
+    $columnsQuery .= " FROM pg_attribute WHERE attrelid='$quotedName'::regclass";
+    $columnsQuery .= " AND attnum > 0 AND NOT attisdropped";
+    my $columnsResult = $masterConn->exec($columnsQuery);
+    unless($columnsResult->resultStatus == PGRES_TUPLES_OK) {
+	logErrorMessage($masterConn->errorMessage . "\n" . $columnsQuery);
+	die;
+    }
+    my ($xmin,$xmax) = split(/:/,$columnsResult->getvalue(0,0));
+    my $columns = $columnsResult->getvalue(0,1);
+
+    #The pending tables hold the transaction id of the subtransaction that
+    #made a change, while the snapshot only lists the running top level
+    #transactions.  Between xmin and xmax of the snapshot a change is part
+    #of the copy when its pending row is visible to the snapshot.
+    $xmin = $xmin & 0xFFFFFFFF;
+    $xmax = $xmax & 0xFFFFFFFF;
+    my $windowCondition = "TableName='$quotedName' AND ((XID::bigint - $xmin)";
+    $windowCondition .= " & 4294967295) < " . (($xmax - $xmin) & 0xFFFFFFFF);
+    my $visibleQuery = "SELECT XID FROM dbmirror_Pending WHERE $windowCondition";
+    if($hasPendingLog) {
+	$visibleQuery .= " UNION SELECT XID FROM dbmirror_PendingLog";
+	$visibleQuery .= " WHERE $windowCondition";
+    }
+    my $visibleResult = $masterConn->exec($visibleQuery);
+    unless($visibleResult->resultStatus == PGRES_TUPLES_OK) {
+	logErrorMessage($masterConn->errorMessage . "\n" . $visibleQuery);
+	die;
+    }
+    my @visibleXIDs;
+    for(my $row = 0; $row < $visibleResult->ntuples; $row++) {
+	push @visibleXIDs, $visibleResult->getvalue($row,0) & 0xFFFFFFFF;
+    }
+    my $snapshot = "$xmin:$xmax:" . join(',',@visibleXIDs);
+
+    #Errors on the slave are handled by resyncFailed instead of
+    #slaveQueryFailed so a table that can't be copied doesn't stop the
+    #replay of the other changes.
+    my $copyIn = "COPY $tableName ($columns) FROM STDIN";
+    foreach my $query ("BEGIN","TRUNCATE $tableName",$copyIn) {
+	my $result = $slaveConn->exec($query);
+	unless($result->resultStatus ==
+	       ($query eq $copyIn ? PGRES_COPY_IN : PGRES_COMMAND_OK)) {
+	    $masterConn->exec("COMMIT");
+	    resyncFailed($tableName,$query);
+	    return;
+	}
+    }
+
+    my $copyOut = "COPY $tableName ($columns) TO STDOUT";
+    my $copyResult = $masterConn->exec($copyOut);
+    unless($copyResult->resultStatus == PGRES_COPY_OUT) {
+	logErrorMessage($masterConn->errorMessage . "\n" . $copyOut);
+	die;
+    }
+    my $numRows = 0;
+    while(defined(my $line = readCopyLine())) {
+	$slaveConn->putline($line . "\n");
+	$numRows++;
+    }
+    $masterConn->endcopy;
+    $masterConn->exec("COMMIT");
+    $slaveConn->putline("\\.\n");
+    if($slaveConn->endcopy != 0) {
+	resyncFailed($tableName,$copyIn);
+	return;
+    }
+
+    foreach my $query ("DELETE FROM dbmirror_Resync WHERE" .
+		       " TableName='$quotedName'",
+		       "INSERT INTO dbmirror_Resync (TableName,Snapshot)" .
+		       " VALUES ('$quotedName','$snapshot')",
+		       "COMMIT") {
+	my $result = $slaveConn->exec($query);
+	unless($result->resultStatus == PGRES_COMMAND_OK) {
+	    resyncFailed($tableName,$query);
+	    return;
+	}
+    }
+    $resyncSnapshots{$tableName} = parseSnapshot($snapshot);
+    $metrics{"tablesResynced"}++;
+    $metrics{"rowsResynced"} += $numRows;
+    observeStage("resync",time - $startTime);
+}
+
+
+=item resyncFailed(tableName,query)
+
+Logs a query of resyncTable that failed on the slave and rolls back the
+slave transaction.  Unless the connection to the slave was lost, the table
+is added to noResyncTables so it isn't tried again and its changes are
+replayed.  Unlike slaveQueryFailed this leaves the slave usable, so the
+other changes are still mirrored (ie. when the slave user isn't allowed to
+TRUNCATE the table).  A lost connection is handled like in
+slaveQueryFailed.
+
+=cut
+
+sub resyncFailed($$) {
+    my ($tableName,$query) = @_;
+    my $slaveConn = $::slaveInfo->{"slaveConn"};
+
+    logErrorMessage("Can't resync $tableName, its changes are replayed" .
+		    " instead\n" . $slaveConn->errorMessage . "\n" . $query);
+    $slaveConn->exec("ROLLBACK");
+    if($slaveConn->status == PGRES_CONNECTION_OK) {
+	$noResyncTables{$tableName} = 1;
+    }
+    else {
+	$::slaveInfo->{"status"} = -1;
+    }
+}
+
+
+=item coveredCondition(tableNames)
+
+Builds an SQL condition on the TableName and XID columns of the pending
+tables that is true for the changes to the given tables that are already
+part of their copy made by resyncTable.  That is the case if the
+transaction had committed when the snapshot of the copy was taken.  Every
+transaction with pending changes has committed.  A transaction id older
+than the xmin of the snapshot belongs to a transaction (or a subtransaction
+of one) that had committed by then, one newer than xmax did not.  In
+between the changes that were visible to the snapshot were recorded by
+resyncTable.  Transaction ids are compared modulo 2^32.
+
+=over 4
+
+=item * tableNames
+
+The tables in resyncSnapshots to build the condition for.
+
+=item returns
+
+The condition, which is false if no table is given.
+
+=back
+
+=cut
+
+sub coveredCondition(@) {
+    my @conditions;
+    foreach my $tableName (sort @_) {
+	my $snapshot = $resyncSnapshots{$tableName};
+	my $quotedName = $tableName;
+	$quotedName =~ s/'/''/g;
+	#The pending tables hold the 32 bit transaction ids as an integer.
+	my $condition = "(TableName='$quotedName' AND (((XID::bigint - ";
+	$condition .= $snapshot->{"xmin"} . ") & 4294967295) >= 2147483648";
+	my @visibleXIDs = sort {$a <=> $b} keys %{$snapshot->{"visible"}};
+	if(@visibleXIDs) {
+	    $condition .= " OR (XID::bigint & 4294967295) IN (";
+	    $condition .= join(',',@visibleXIDs) . ")";
+	}
+	$condition .= "))";
+	push @conditions, $condition;
+    }
+    unless(@conditions) {
+	return "false";
+    }
+    return "(" . join(" OR ",@conditions) . ")";
+}
+
+
+=item markMirrored(lastSeqIds)
+
+Records on the master that transactions have been mirrored to the slave,
+with acknowledgeTransactions if $idempotentApply is set and with
+updateMirrorHostTable otherwise.
+
+=over 4
+
+=item * lastSeqIds
+
+A hash of the Transaction ids of the transactions with the Sequence Id of
+the last command of each transaction.
+
+=back
+
+=cut
+
+sub markMirrored($) {
+    my $lastSeqIds = $_[0];
+
+    if($::idempotentApply) {
+	foreach my $transId (keys %$lastSeqIds) {
+	    $appliedTransIds{$transId} = 1;
+	    $unackedSeqIds{$transId} = $lastSeqIds->{$transId};
+	}
+	acknowledgeTransactions(0);
+    }
+    else {
+	updateMirrorHostTable($lastSeqIds);
+    }
+}
+
+
+=item parseSnapshot(snapshot)
+
+Parses a snapshot stored by resyncTable.  It is made up of the xmin and
+xmax of the snapshot and the transaction ids between them whose changes to
+the table were visible to the snapshot, as 32 bit transaction ids.
+
+=over 4
+
+=item returns
+
+A hash reference with the xmin, the xmax and a hash of the visible
+transaction ids (visible).
+
+=back
+
+=cut
+
+sub parseSnapshot($) {
+    my ($xmin,$xmax,$visible) = split(/:/,$_[0]);
+    my %snapshot = ("xmin" => $xmin,
+		    "xmax" => $xmax,
+		    "visible" => {});
+    if(defined $visible) {
+	foreach my $xid (split(/,/,$visible)) {
+	    $snapshot{"visible"}->{$xid} = 1;
+	}
+    }
+    return \%snapshot;
+}
+
+
+=item sendQueryToSlaves(seqId,sqlQuery)
+
+Sends an SQL query to the slave.
+
+
+=over 4
 
 =item * seqId
 
@@ -697,14 +1791,7 @@ sub sendQueryToSlaves($$) {
    if($::slaveInfo->{"status"} eq 'DBOpen') {
        my $queryResult = $::slaveInfo->{"slaveConn"}->exec($sqlQuery);
        unless($queryResult->resultStatus == PGRES_COMMAND_OK) {
-	   my $errorMessage;
-	   $errorMessage = "Error sending query  $seqId to " ;
-	   $errorMessage .= $::slaveInfo->{"slaveHost"};
-	   $errorMessage .=$::slaveInfo->{"slaveConn"}->errorMessage;
-	   $errorMessage .= "\n" . $sqlQuery;
-	   logErrorMessage($errorMessage);
-	   $::slaveInfo->{"slaveConn"}->exec("ROLLBACK");
-	   $::slaveInfo->{"status"} = -1;
+	   slaveQueryFailed($seqId,$sqlQuery);
        }
    }
     elsif($::slaveInfo->{"status"} eq 'FileOpen' ) {
@@ -719,6 +1806,31 @@ sub sendQueryToSlaves($$) {
 
 
 
+=item slaveQueryFailed(seqId,sqlQuery)
+
+Reports a query that failed on the slave and rolls back the slave
+transaction.
+
+=cut
+
+sub slaveQueryFailed($$) {
+    my $seqId = $_[0];
+    my $sqlQuery = $_[1];
+
+    my $errorMessage;
+    $errorMessage = "Error sending query  $seqId to " ;
+    $errorMessage .= $::slaveInfo->{"slaveHost"};
+    $errorMessage .=$::slaveInfo->{"slaveConn"}->errorMessage;
+    $errorMessage .= "\n" . $sqlQuery;
+    logErrorMessage($errorMessage);
+    $metrics{"applyErrors"}++;
+    $::slaveInfo->{"slaveConn"}->exec("ROLLBACK");
+    $::slaveInfo->{"status"} = -1;
+}
+
+
+
+
 =item logErrorMessage(error)
 
 Mails an error message to the users specified $errorEmailAddr
@@ -802,7 +1914,6 @@ sub setupSlave($) {
 	    openSlaveConnection($::slaveInfo);
 	}
 	sendQueryToSlaves(undef,"SET TRANSACTION ISOLATION LEVEL SERIALIZABLE");
-	sendQueryToSlaves(undef,"SET CONSTRAINTS ALL DEFERRED");
     }
     else {
 	$::slaveInfo->{"status"} = 'FileClosed';
@@ -811,21 +1922,19 @@ sub setupSlave($) {
 
 }
 
-=item updateMirrorHostTable(lastTransId,lastSeqId)
+=item updateMirrorHostTable(lastSeqIds)
 
 Updates the MirroredTransaction table to reflect the fact that
-this transaction has been sent to the current slave.
+these transactions have been sent to the current slave.  This is done in a
+single round trip to the master.
 
 =over 4 
 
-=item * lastTransId
-
-The Transaction id for the last transaction that has been succesfully mirrored to
-the currently open slaves.
-
-=item * lastSeqId 
+=item * lastSeqIds
 
-The Sequence Id of the last command that has been succefully mirrored
+A hash of the Transaction ids of the transactions that have been
+succesfully mirrored to the currently open slaves.  The values are the
+Sequence Id of the last command of each transaction.
 
 
 =back
@@ -833,18 +1942,10 @@ The Sequence Id of the last command that has been succefully mirrored
 
 =cut
 
-sub updateMirrorHostTable($$) {
-    my $lastTransId = shift;
-    my $lastSeqId = shift;
+sub updateMirrorHostTable($) {
+    my $lastSeqIds = shift;
 
-
-    
-    my $deleteTransactionQuery;
-    my $deleteResult;
-    my $updateMasterQuery = "INSERT INTO dbmirror_MirroredTransaction ";
-    $updateMasterQuery .= " (XID,LastSeqId,MirrorHostId)";
-    $updateMasterQuery .= " VALUES ($lastTransId,$lastSeqId,$::slaveInfo->{\"MirrorHostId\"}) ";
-    
+    my $updateMasterQuery = mirrorHostTableQuery($lastSeqIds);
     my $updateResult = $masterConn->exec($updateMasterQuery);
     unless($updateResult->resultStatus == PGRES_COMMAND_OK) {
 	my $errorMessage = $masterConn->errorMessage . "\n";
@@ -854,32 +1955,399 @@ sub updateMirrorHostTable($$) {
     }
 #	print "Updated slaves to transaction $lastTransId\n" ;	 
 #        flush STDOUT;  
+}
+
+
+=item mirrorHostTableQuery(lastSeqIds)
+
+Returns the SQL statements that record the transactions in lastSeqIds as
+mirrored to the current slave and delete the transactions that have now
+been mirrored to all mirror hosts.
 
-    #If this transaction has now been mirrored to all mirror hosts
+=cut
+
+sub mirrorHostTableQuery($) {
+    my $lastSeqIds = shift;
+    my @transIds = sort { $a <=> $b } keys %$lastSeqIds;
+    my $transIdList = join(',',@transIds);
+
+    my $updateMasterQuery = "INSERT INTO dbmirror_MirroredTransaction ";
+    $updateMasterQuery .= " (XID,LastSeqId,MirrorHostId) VALUES ";
+    $updateMasterQuery .= join(',',map { "($_,$lastSeqIds->{$_},"
+					     . $::slaveInfo->{"MirrorHostId"}
+					     . ")" } @transIds);
+
+    #If a transaction has now been mirrored to all mirror hosts
     #then it can be deleted.
-    $deleteTransactionQuery = 'DELETE FROM dbmirror_Pending WHERE XID='
-	. $lastTransId . ' AND (SELECT COUNT(*) FROM dbmirror_MirroredTransaction'
-	. ' WHERE XID=' . $lastTransId . ')=(SELECT COUNT(*) FROM'
+    my $deleteTransactionQuery = 'DELETE FROM dbmirror_Pending WHERE XID IN ('
+	. $transIdList . ') AND (SELECT COUNT(*) FROM dbmirror_MirroredTransaction'
+	. ' WHERE XID=dbmirror_Pending.XID)=(SELECT COUNT(*) FROM'
 	. ' dbmirror_MirrorHost)';
-    
-    $deleteResult = $masterConn->exec($deleteTransactionQuery);
-    if($deleteResult->resultStatus!=PGRES_COMMAND_OK) { 
-	logErrorMessage($masterConn->errorMessage . "\n" . 
-			$deleteTransactionQuery);
+    if($hasPendingLog) {
+	#Without the cascade from dbmirror_Pending the changes in
+	#dbmirror_PendingLog and the MirroredTransaction rows have to be
+	#deleted along with it.
+	$deleteTransactionQuery = 'WITH Done AS (SELECT XID FROM'
+	    . ' dbmirror_MirroredTransaction WHERE XID IN (' . $transIdList
+	    . ') GROUP BY XID HAVING COUNT(*)=(SELECT COUNT(*) FROM'
+	    . ' dbmirror_MirrorHost)),'
+	    . ' DeletePending AS (DELETE FROM dbmirror_Pending WHERE XID IN'
+	    . ' (SELECT XID FROM Done)),'
+	    . ' DeleteLog AS (DELETE FROM dbmirror_PendingLog WHERE XID IN'
+	    . ' (SELECT XID FROM Done))'
+	    . ' DELETE FROM dbmirror_MirroredTransaction WHERE XID IN'
+	    . ' (SELECT XID FROM Done)';
+    }
+
+    return $updateMasterQuery . ";\n" . $deleteTransactionQuery;
+}
+
+
+=item acknowledgeTransactions(force)
+
+Used instead of updateMirrorHostTable when $idempotentApply is set.
+The transactions applied to the slave are recorded on the master in batches
+over a separate connection without waiting for the master to finish.  A
+batch is sent once $ackInterval seconds have passed or $ackBatchSize
+transactions are waiting.  If force is set any waiting transactions are
+sent and the result is waited for.
+
+Applied transactions stay in appliedTransIds until the master has
+confirmed them so that they are not applied again.  If the master fails
+to record them they are sent again with the next batch.  They must not be
+applied again: the slave already has them, and replaying them without the
+later transactions that changed the same rows would undo those changes.
+
+=cut
+
+sub acknowledgeTransactions($) {
+    my $force = shift;
+
+    if(defined $ackInFlight) {
+	$ackConn->consumeInput;
+	unless($force || !$ackConn->isBusy) {
+	    return;
+	}
+	my $ackOk = 1;
+	while(defined(my $ackResult = $ackConn->getResult)) {
+	    $ackOk = 0 if $ackResult->resultStatus != PGRES_COMMAND_OK;
+	}
+	if($ackOk) {
+	    foreach my $transId (keys %{$ackInFlight->{"lastSeqIds"}}) {
+		delete $appliedTransIds{$transId};
+	    }
+	}
+	else {
+	    logErrorMessage($ackConn->errorMessage . "\n" . $ackInFlight->{"query"});
+	    #Retry with the next batch.
+	    %unackedSeqIds = (%{$ackInFlight->{"lastSeqIds"}}, %unackedSeqIds);
+	}
+	$ackInFlight = undef;
+    }
+
+    my $numUnacked = scalar(keys %unackedSeqIds);
+    if($numUnacked == 0 ||
+       (!$force && $numUnacked < $::ackBatchSize &&
+	time - $lastAckTime < $::ackInterval)) {
+	return;
+    }
+
+    my %lastSeqIds = %unackedSeqIds;
+    %unackedSeqIds = ();
+    my $ackQuery = mirrorHostTableQuery(\%lastSeqIds);
+    unless($ackConn->sendQuery($ackQuery)) {
+	logErrorMessage($ackConn->errorMessage . "\n" . $ackQuery);
 	die;
     }
-    
-  
+    $ackInFlight = {"query" => $ackQuery, "lastSeqIds" => \%lastSeqIds};
+    $lastAckTime = time;
+    if($force) {
+	acknowledgeTransactions(1);
+    }
+}
+
+
+=item commitLag(pendingTransResults,tuple)
+
+Returns the number of seconds since the transaction in the given tuple of
+the pending transaction list was committed on the master, or 0 if tuple is
+past the end of the list.
+
+=cut
+
+sub commitLag($$) {
+    my $pendingTransResults = $_[0];
+    my $tuple = $_[1];
+
+    if($tuple >= $pendingTransResults->ntuples) {
+	return 0;
+    }
+    my $commitTime = $pendingTransResults->getvalue($tuple,5);
+    #Transactions from before track_commit_timestamp was turned on have
+    #no commit time.
+    if($commitTime eq '') {
+	return undef;
+    }
+    return time - $commitTime;
+}
+
+
+=item observeStage(stage,seconds)
+
+Records the time spent in one stage of applying a batch of transactions
+in the stage timing histogram.  The stages are fetch (querying the pending
+rows from the master), decode (turning them into commands), slave (executing
+the commands on the slave) and bookkeeping (updateMirrorHostTable).
+
+=cut
+
+sub observeStage($$) {
+    my $stage = $_[0];
+    my $seconds = $_[1];
+
+    my $histogram = $metrics{"stages"}->{$stage};
+    unless(defined $histogram) {
+	$histogram = {"buckets" => [map { 0 } @stageBuckets],
+		      "sum" => 0, "count" => 0};
+	$metrics{"stages"}->{$stage} = $histogram;
+    }
+    for(my $bucket = 0; $bucket <= $#stageBuckets; $bucket++) {
+	if($seconds <= $stageBuckets[$bucket]) {
+	    $histogram->{"buckets"}->[$bucket]++;
+	}
+    }
+    $histogram->{"sum"} += $seconds;
+    $histogram->{"count"}++;
+}
+
+
+=item setupMetrics()
+
+Opens the socket the metrics are served on if $metricsPort is set.
+
+=cut
+
+sub setupMetrics() {
+    if(defined($::metricsPort)) {
+	$metricsSocket = IO::Socket::INET->new(LocalAddr => '127.0.0.1',
+					       LocalPort => $::metricsPort,
+					       Proto => 'tcp',
+					       Listen => 5,
+					       ReuseAddr => 1);
+	unless(defined $metricsSocket) {
+	    logErrorMessage("Can't listen on metrics port $::metricsPort: $!");
+	    die;
+	}
+	#A client that goes away before reading the answer must not end
+	#the mirroring.
+	$SIG{PIPE} = 'IGNORE';
+    }
+}
+
+
+=item waitForWork(seconds)
+
+Sleeps for the given number of seconds, answering requests for the
+metrics in the meantime.
+
+=cut
+
+sub waitForWork($) {
+    my $deadline = time + $_[0];
+
+    if($::idempotentApply) {
+	acknowledgeTransactions(1);
+    }
+    writeMetrics(1);
+    unless(defined $metricsSocket) {
+	sleep $_[0];
+	return;
+    }
+    my $now = time;
+    while($now < $deadline) {
+	serveMetrics($deadline - $now);
+	$now = time;
+    }
+}
+
 
+=item writeMetrics(force)
+
+Rewrites $metricsFile and the status row of the slave in
+dbmirror_MirrorHostStatus on the master.  Unless force is set this is only
+done every $metricsInterval seconds.  Pending requests for the metrics
+on $metricsPort are answered either way.
+
+=cut
+
+sub writeMetrics($) {
+    my $force = $_[0];
+    my $now = time;
+
+    serveMetrics(0);
+    if(!$force && $now - $lastMetricsWrite < $::metricsInterval) {
+	return;
+    }
+    my $rowsPerSecond = 0;
+    if($lastMetricsWrite > 0 && $now > $lastMetricsWrite) {
+	$rowsPerSecond = ($metrics{"rowsApplied"} - $lastRowsApplied) /
+	    ($now - $lastMetricsWrite);
+    }
+    $lastMetricsWrite = $now;
+    $lastRowsApplied = $metrics{"rowsApplied"};
+
+    if(defined($::metricsFile)) {
+	my $metricsOut;
+	if(open($metricsOut, ">$::metricsFile.tmp")) {
+	    print $metricsOut metricsText();
+	    close($metricsOut);
+	    rename("$::metricsFile.tmp",$::metricsFile);
+	}
+	else {
+	    logErrorMessage("Can't write $::metricsFile.tmp: $!");
+	}
+    }
+
+    unless($hasStatusTable && defined($::slaveInfo->{"MirrorHostId"})) {
+	return;
+    }
+    my $statusQuery = "INSERT INTO dbmirror_MirrorHostStatus (MirrorHostId,";
+    $statusQuery .= " LagTransactions,LagSeconds,TransactionsApplied,";
+    $statusQuery .= " RowsApplied,RowsPerSecond,ApplyErrors,UpdatedAt)";
+    $statusQuery .= sprintf(" VALUES (%d,%d,%s,%d,%d,%.3f,%d,now())",
+			    $::slaveInfo->{"MirrorHostId"},
+			    $metrics{"lagTransactions"},
+			    defined($metrics{"lagSeconds"}) ?
+			    sprintf("%.3f",$metrics{"lagSeconds"}) : "null",
+			    $metrics{"transactionsApplied"},
+			    $metrics{"rowsApplied"},
+			    $rowsPerSecond,
+			    $metrics{"applyErrors"});
+    $statusQuery .= " ON CONFLICT (MirrorHostId) DO UPDATE SET";
+    $statusQuery .= " LagTransactions=EXCLUDED.LagTransactions,";
+    $statusQuery .= " LagSeconds=EXCLUDED.LagSeconds,";
+    $statusQuery .= " TransactionsApplied=EXCLUDED.TransactionsApplied,";
+    $statusQuery .= " RowsApplied=EXCLUDED.RowsApplied,";
+    $statusQuery .= " RowsPerSecond=EXCLUDED.RowsPerSecond,";
+    $statusQuery .= " ApplyErrors=EXCLUDED.ApplyErrors,";
+    $statusQuery .= " UpdatedAt=EXCLUDED.UpdatedAt";
+
+    #The status row is informational, failing to write it is not fatal.
+    my $statusResult = $masterConn->exec($statusQuery);
+    unless($statusResult->resultStatus == PGRES_COMMAND_OK) {
+	logErrorMessage($masterConn->errorMessage . "\n" . $statusQuery);
+    }
 }
 
 
-sub extractData($$) {
+=item metricsText()
+
+Returns the metrics in the Prometheus text exposition format.
+
+=cut
+
+sub metricsText() {
+    my $labels = 'slave="' . $::slaveInfo->{"slaveName"} . '"';
+    my $text = '';
+
+    my @counters = (["transactionsApplied","dbmirror_transactions_applied_total",
+		     "Master transactions applied to the slave."],
+		    ["rowsFetched","dbmirror_rows_fetched_total",
+		     "Row changes read from the pending tables."],
+		    ["rowsApplied","dbmirror_rows_applied_total",
+		     "Row changes applied to the slave."],
+		    ["applyErrors","dbmirror_apply_errors_total",
+		     "Statements that failed on the slave."],
+		    ["tablesResynced","dbmirror_tables_resynced_total",
+		     "Tables copied to the slave to catch up."],
+		    ["rowsResynced","dbmirror_rows_resynced_total",
+		     "Rows copied to the slave to catch up."],
+		    ["changesSkipped","dbmirror_changes_skipped_total",
+		     "Row changes skipped because their table was copied."]);
+    foreach my $counter (@counters) {
+	my ($key,$name,$help) = @$counter;
+	$text .= "# HELP $name $help\n# TYPE $name counter\n";
+	$text .= "$name\{$labels\} $metrics{$key}\n";
+    }
+
+    $text .= "# HELP dbmirror_lag_transactions Transactions waiting to be" .
+	" applied to the slave.\n";
+    $text .= "# TYPE dbmirror_lag_transactions gauge\n";
+    $text .= "dbmirror_lag_transactions\{$labels\} " .
+	$metrics{"lagTransactions"} . "\n";
+    if(defined $metrics{"lagSeconds"}) {
+	$text .= "# HELP dbmirror_lag_seconds Age of the oldest transaction" .
+	    " waiting to be applied to the slave.\n";
+	$text .= "# TYPE dbmirror_lag_seconds gauge\n";
+	$text .= sprintf("dbmirror_lag_seconds{%s} %.3f\n",$labels,
+			 $metrics{"lagSeconds"});
+    }
+
+    $text .= "# HELP dbmirror_stage_seconds Time spent in each stage of" .
+	" applying transactions.\n";
+    $text .= "# TYPE dbmirror_stage_seconds histogram\n";
+    foreach my $stage (sort keys %{$metrics{"stages"}}) {
+	my $histogram = $metrics{"stages"}->{$stage};
+	my $stageLabels = $labels . ",stage=\"$stage\"";
+	for(my $bucket = 0; $bucket <= $#stageBuckets; $bucket++) {
+	    $text .= "dbmirror_stage_seconds_bucket\{$stageLabels," .
+		"le=\"$stageBuckets[$bucket]\"\} " .
+		$histogram->{"buckets"}->[$bucket] . "\n";
+	}
+	$text .= "dbmirror_stage_seconds_bucket\{$stageLabels,le=\"+Inf\"\} " .
+	    $histogram->{"count"} . "\n";
+	$text .= sprintf("dbmirror_stage_seconds_sum{%s} %.6f\n",$stageLabels,
+			 $histogram->{"sum"});
+	$text .= "dbmirror_stage_seconds_count\{$stageLabels\} " .
+	    $histogram->{"count"} . "\n";
+    }
+    return $text;
+}
+
+
+=item serveMetrics(timeout)
+
+Answers the requests for the metrics that arrive on $metricsPort within
+timeout seconds.  Any request is answered with the metrics.  A client gets
+at most a second to send its request so a slow or broken client can't hold
+up the mirroring.
+
+=cut
+
+sub serveMetrics($) {
+    my $timeout = $_[0];
+    unless(defined $metricsSocket) {
+	return;
+    }
+    my $select = IO::Select->new($metricsSocket);
+    while($select->can_read($timeout)) {
+	my $client = $metricsSocket->accept;
+	next unless defined $client;
+	my $clientSelect = IO::Select->new($client);
+	#Read the request headers up to the blank line.
+	my $request = '';
+	my $deadline = time + 1;
+	while($request !~ m/\r?\n\r?\n/ && length($request) < 65536) {
+	    my $remaining = $deadline - time;
+	    last if $remaining <= 0 || !$clientSelect->can_read($remaining);
+	    last unless sysread($client,$request,4096,length($request));
+	}
+	my $body = metricsText();
+	print $client "HTTP/1.0 200 OK\r\n";
+	print $client "Content-Type: text/plain; version=0.0.4\r\n";
+	print $client "Content-Length: " . length($body) . "\r\n\r\n";
+	print $client $body;
+	close($client);
+	$timeout = 0;
+    }
+}
+
+
+sub extractData($$$) {
   my $pendingResult = $_[0];
   my $currentTuple = $_[1];
-  my $fnumber;
+  my $fnumber = $_[2];
   my %valuesHash;
-  $fnumber = 4;
   my $dataField = $pendingResult->getvalue($currentTuple,$fnumber);
 
   while(length($dataField)>0) {
@@ -894,6 +2362,11 @@ sub extractData($$) {
 	$dataField = substr $dataField , length($1);
       $valuesHash{$fieldName}=undef;
     }
+    elsif ($dataField =~ m/(^=#([bt])([0-9a-f]+) )/s) {
+      #A reference to a value in dbmirror_LargeValue.
+      $dataField = substr $dataField , length($1);
+      $valuesHash{$fieldName} = {"largeValue" => $3, "binary" => $2 eq 'b'};
+    }
     elsif ($dataField =~ m/(^=\')/s) {
       #Has data.
       my $value;
@@ -32,13 +32,49 @@ CREATE TABLE dbmirror_PendingData (
     FOREIGN KEY (SeqId) REFERENCES dbmirror_Pending (SeqId) ON UPDATE CASCADE  ON DELETE CASCADE
 );
 
+-- Changes are written here instead of to dbmirror_Pending and
+-- dbmirror_PendingData when dbmirror.pending_log is on.  Each change is a
+-- single row holding both the key data and the data of the row.
+-- See MirrorUpgradeLog.sql.
+CREATE TABLE dbmirror_PendingLog (
+    SeqId integer NOT NULL DEFAULT nextval('dbmirror_pending_seqid_seq'),
+    TableName name NOT NULL,
+    Op character,
+    XID integer NOT NULL,
+    KeyData varchar,
+    Data varchar
+);
+
+CREATE INDEX dbmirror_PendingLog_XID_Index ON dbmirror_PendingLog (XID);
+
+-- Values larger than dbmirror.large_value_threshold, split into chunks and
+-- keyed by the SHA-256 hash of the value.  The change records refer to them
+-- by their hash.
+CREATE TABLE dbmirror_LargeValue (
+    Hash text NOT NULL,
+    ChunkNo integer NOT NULL,
+    Data bytea NOT NULL,
+    PRIMARY KEY (Hash, ChunkNo)
+);
+
 CREATE TABLE dbmirror_MirroredTransaction (
     XID integer NOT NULL,
     LastSeqId integer NOT NULL,
     MirrorHostId integer NOT NULL,
     PRIMARY KEY (XID, MirrorHostId),
-    FOREIGN KEY (MirrorHostId) REFERENCES dbmirror_MirrorHost (MirrorHostId) ON UPDATE CASCADE ON DELETE CASCADE,
-    FOREIGN KEY (LastSeqId) REFERENCES dbmirror_Pending (SeqId)  ON UPDATE CASCADE ON DELETE CASCADE
+    FOREIGN KEY (MirrorHostId) REFERENCES dbmirror_MirrorHost (MirrorHostId) ON UPDATE CASCADE ON DELETE CASCADE
+);
+
+CREATE TABLE dbmirror_MirrorHostStatus (
+    MirrorHostId integer PRIMARY KEY,
+    LagTransactions integer NOT NULL,
+    LagSeconds double precision,
+    TransactionsApplied bigint NOT NULL,
+    RowsApplied bigint NOT NULL,
+    RowsPerSecond double precision NOT NULL,
+    ApplyErrors bigint NOT NULL,
+    UpdatedAt timestamp with time zone NOT NULL,
+    FOREIGN KEY (MirrorHostId) REFERENCES dbmirror_MirrorHost (MirrorHostId) ON UPDATE CASCADE ON DELETE CASCADE
 );
 
 UPDATE pg_proc SET proname='nextval_pg' WHERE proname='nextval';
@@ -0,0 +1,19 @@
+-- Adds the dbmirror_LargeValue table to an existing dbmirror installation.
+--
+-- Run with "psql -f MirrorUpgradeLargeValue.sql MyDatabaseName" against the
+-- master after installing the new pending.so, DBMirror.pl and
+-- clean_pending.pl, and before setting dbmirror.large_value_threshold.
+-- Each slave needs the dbmirror_LargeValue table from SlaveSetup.sql too.
+BEGIN;
+
+-- Values larger than dbmirror.large_value_threshold, split into chunks and
+-- keyed by the SHA-256 hash of the value.  The change records refer to them
+-- by their hash.
+CREATE TABLE IF NOT EXISTS dbmirror_LargeValue (
+    Hash text NOT NULL,
+    ChunkNo integer NOT NULL,
+    Data bytea NOT NULL,
+    PRIMARY KEY (Hash, ChunkNo)
+);
+
+COMMIT;
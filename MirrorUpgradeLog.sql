@@ -0,0 +1,35 @@
+-- Moves an existing dbmirror installation to the single table
+-- dbmirror_PendingLog layout.
+--
+-- Run with "psql -f MirrorUpgradeLog.sql MyDatabaseName" after installing
+-- the new pending.so and DBMirror.pl.  Changes already in dbmirror_Pending
+-- are still mirrored by DBMirror.pl.  New sessions write their changes to
+-- dbmirror_PendingLog.
+BEGIN;
+
+-- nextval() has been replaced by the mirroring version in MirrorSetup.sql
+-- so the original function has to be used for the default.
+CREATE TABLE dbmirror_PendingLog (
+    SeqId integer NOT NULL DEFAULT nextval_pg('dbmirror_pending_seqid_seq'),
+    TableName name NOT NULL,
+    Op character,
+    XID integer NOT NULL,
+    KeyData varchar,
+    Data varchar
+);
+
+CREATE INDEX dbmirror_PendingLog_XID_Index ON dbmirror_PendingLog (XID);
+
+-- Rows in dbmirror_MirroredTransaction can refer to changes in either
+-- table.  DBMirror.pl and clean_pending.pl now delete them explicitly.
+ALTER TABLE dbmirror_MirroredTransaction
+    DROP CONSTRAINT IF EXISTS dbmirror_mirroredtransaction_lastseqid_fkey;
+
+DO $$
+BEGIN
+    EXECUTE format('ALTER DATABASE %I SET dbmirror.pending_log = on',
+                   current_database());
+END
+$$;
+
+COMMIT;
@@ -0,0 +1,24 @@
+-- Run against each slave database ("psql -f SlaveSetup.sql MyDatabaseName")
+-- if dbmirror.large_value_threshold is used on the master or $resyncRatio
+-- is set for DBMirror.pl.
+--
+-- DBMirror.pl copies large values into this table before the statements
+-- that use them.  Values the slave already has are not sent again.
+-- Nothing removes values from it, so it grows without bound.  It is only a
+-- cache and can be emptied with TRUNCATE at any time; the values are sent
+-- again when they are used.
+CREATE TABLE dbmirror_LargeValue (
+    Hash text NOT NULL,
+    ChunkNo integer NOT NULL,
+    Data bytea NOT NULL,
+    PRIMARY KEY (Hash, ChunkNo)
+);
+
+-- The tables DBMirror.pl copied from the master to catch up, with the
+-- snapshot of the copy (see resyncTable in DBMirror.pl).  The pending changes to the table
+-- that are part of the copy are skipped.  A row is removed once they have
+-- all been skipped.
+CREATE TABLE dbmirror_Resync (
+    TableName name PRIMARY KEY,
+    Snapshot text NOT NULL
+);
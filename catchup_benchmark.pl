@@ -0,0 +1,328 @@
+#!/usr/bin/perl
+# catchup_benchmark.pl
+# This perl script measures how long DBMirror.pl takes to bring a slave
+# up to date after an outage, with and without resyncing tables.
+#
+#
+##############################################################################
+
+
+=head1 NAME
+
+catchup_benchmark.pl - A Perl script to benchmark catching up after a
+simulated outage of a slave.
+
+
+=head1 SYNPOSIS
+
+
+catchup_benchmark.pl slaveConfigfile.conf [days [changesPerDay [rows]]]
+
+
+=head1 DESCRIPTION
+
+
+This Perl script uses the same configuration file as DBMirror.pl.  It
+should only be run against a test master and slave where no DBMirror.pl is
+running and nothing else is waiting to be mirrored to the slave.
+
+It creates the dbmirror_bench_catchup table with rows rows (10000 by
+default) on the master and the slave and adds the recordchange trigger to
+it on the master.  An outage of days days (3 by default) is then simulated
+by making changesPerDay (100000 by default) updates per day to random rows
+of the table on the master, in transactions of 10 updates, while nothing
+is mirrored.
+
+DBMirror.pl is started afterwards and the time until every pending
+transaction has been mirrored is measured.  This is done twice, with the
+same backlog: first with $resyncRatio set to 0 so every change is replayed,
+then with $resyncRatio set to 1 so the table is copied instead.  The
+contents of the table on the master and the slave are compared after each
+run.
+
+One line is printed per run with the number of changes, the time it took
+to catch up, the changes per second, whether DBMirror.pl copied the table
+(it replays the changes instead if the copy fails on the slave) and whether
+the slave matches the master afterwards.  The results depend on the
+hardware, the network between the master and the slave and the PostgreSQL
+versions, so no reference numbers are shipped.
+
+The table and its pending changes are removed at the end.
+
+=cut
+
+BEGIN {
+    # add in a global path to files
+    #Ensure that Pg is in the path.
+}
+
+
+use strict;
+use Pg;
+use File::Basename;
+use File::Spec;
+use File::Temp qw(tempfile);
+use POSIX qw(:sys_wait_h);
+use Time::HiRes qw(time sleep);
+
+sub connectToDatabase($$$$$);
+sub execute($$);
+sub resetTable($);
+sub simulateOutage($$);
+sub catchUpTime($);
+sub wasCopied();
+sub tableHash($);
+
+local $::masterHost;
+local $::masterPort;
+local $::masterDb;
+local $::masterUser;
+local $::masterPassword;
+
+my %slaveInfoHash;
+local $::slaveInfo = \%slaveInfoHash;
+
+my $tableName = 'dbmirror_bench_catchup';
+
+if ($#ARGV < 0 || $#ARGV > 3) {
+    die "usage: catchup_benchmark.pl configFile [days [changesPerDay [rows]]]\n";
+}
+
+my ($configFile,$days,$changesPerDay,$rows) = @ARGV;
+$days = 3 unless defined $days;
+$changesPerDay = 100000 unless defined $changesPerDay;
+$rows = 10000 unless defined $rows;
+if( ! defined do $configFile) {
+    die("Invalid Configuration file $configFile");
+}
+unless(defined($::slaveInfo->{"slaveDb"})) {
+    die("catchup_benchmark.pl needs a slaveDb in $configFile\n");
+}
+
+my $masterConn = connectToDatabase($::masterHost,$::masterPort,$::masterDb,
+				   $::masterUser,$::masterPassword);
+my $slaveConn = connectToDatabase($::slaveInfo->{"slaveHost"},
+				  $::slaveInfo->{"slavePort"},
+				  $::slaveInfo->{"slaveDb"},
+				  $::slaveInfo->{"slaveUser"},
+				  $::slaveInfo->{"slavePassword"});
+
+my $createQuery = "CREATE TABLE $tableName (id integer PRIMARY KEY,";
+$createQuery .= " counter integer NOT NULL, payload text)";
+execute($masterConn,$createQuery);
+execute($masterConn,"CREATE TRIGGER ${tableName}_trig AFTER INSERT OR" .
+	" DELETE OR UPDATE ON $tableName FOR EACH ROW EXECUTE PROCEDURE" .
+	" recordchange()");
+execute($slaveConn,$createQuery);
+
+printf("%-8s %10s %10s %12s %6s %s\n","mode","changes","seconds",
+       "changes/s","copied","slave matches");
+foreach my $resyncRatio (0, 1) {
+    resetTable($rows);
+    simulateOutage($days * $changesPerDay,$rows);
+    my ($seconds,$copied) = catchUpTime($resyncRatio);
+    printf("%-8s %10d %10.1f %12.0f %6s %s\n",
+	   $resyncRatio > 0 ? "resync" : "replay",$days * $changesPerDay,
+	   $seconds,$days * $changesPerDay / $seconds,$copied ? "yes" : "no",
+	   tableHash($masterConn) eq tableHash($slaveConn) ? "yes" : "NO");
+}
+
+execute($masterConn,"DROP TABLE $tableName");
+execute($slaveConn,"DROP TABLE $tableName");
+execute($slaveConn,"DELETE FROM dbmirror_Resync");
+my $pendingLogResult = $masterConn->exec("SELECT to_regclass(" .
+					 "'dbmirror_PendingLog')");
+execute($masterConn,"DELETE FROM dbmirror_Pending WHERE" .
+	" TableName='\"public\".\"$tableName\"'");
+if($pendingLogResult->getvalue(0,0) ne '') {
+    execute($masterConn,"DELETE FROM dbmirror_PendingLog WHERE" .
+	    " TableName='\"public\".\"$tableName\"'");
+}
+
+
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+
+sub connectToDatabase($$$$$) {
+    my ($host,$port,$db,$user,$password) = @_;
+    my $connectString;
+    if(defined($host)) {
+	$connectString .= "host=$host ";
+    }
+    if(defined($port)) {
+	$connectString .= "port=$port ";
+    }
+    $connectString .= "dbname=$db user=$user password=$password";
+
+    my $conn = Pg::connectdb($connectString);
+    unless($conn->status == PGRES_CONNECTION_OK) {
+	die "Can't connect to database $db\n" . $conn->errorMessage;
+    }
+    return $conn;
+}
+
+
+=item execute(conn,query)
+
+Runs a query that doesn't return rows and dies if it fails.
+
+=cut
+
+sub execute($$) {
+    my ($conn,$query) = @_;
+    my $result = $conn->exec($query);
+    unless($result->resultStatus == PGRES_COMMAND_OK) {
+	die $conn->errorMessage . "\n" . $query;
+    }
+}
+
+
+=item resetTable(rows)
+
+Fills the table with the same rows on the master and the slave without
+recording the changes, as if the slave was up to date when the outage
+started.
+
+=cut
+
+sub resetTable($) {
+    my $rows = $_[0];
+    my $fillQuery = "INSERT INTO $tableName SELECT g, 0, repeat('x', 100)";
+    $fillQuery .= " FROM generate_series(1, $rows) g";
+
+    execute($masterConn,"ALTER TABLE $tableName DISABLE TRIGGER" .
+	    " ${tableName}_trig");
+    execute($masterConn,"TRUNCATE $tableName");
+    execute($masterConn,$fillQuery);
+    execute($masterConn,"ALTER TABLE $tableName ENABLE TRIGGER" .
+	    " ${tableName}_trig");
+    execute($masterConn,"ANALYZE $tableName");
+    execute($slaveConn,"TRUNCATE $tableName");
+    execute($slaveConn,$fillQuery);
+    execute($slaveConn,"DELETE FROM dbmirror_Resync");
+}
+
+
+=item simulateOutage(changes,rows)
+
+Makes changes updates to random rows on the master, committing every 10
+updates.  Requires PostgreSQL 11 or later on the master.
+
+=cut
+
+sub simulateOutage($$) {
+    my ($changes,$rows) = @_;
+    my $outageQuery = "DO \$\$ BEGIN FOR t IN 1.." . int($changes / 10);
+    $outageQuery .= " LOOP UPDATE $tableName SET counter = counter + 1";
+    $outageQuery .= " WHERE id IN (SELECT 1 + (random() * ($rows - 1))::int";
+    $outageQuery .= " FROM generate_series(1, 10)); COMMIT; END LOOP; END \$\$";
+    execute($masterConn,$outageQuery);
+}
+
+
+=item catchUpTime(resyncRatio)
+
+Runs DBMirror.pl with the configuration file and resyncRatio until no
+transaction is waiting to be mirrored to the slave.
+
+=over 4
+
+=item returns
+
+The time this took in seconds and whether the table was copied.
+
+=back
+
+=cut
+
+sub catchUpTime($) {
+    my $resyncRatio = $_[0];
+    my ($configHandle,$benchConfigFile) = tempfile(SUFFIX => '.conf',
+						   UNLINK => 1);
+    print $configHandle "do '" . File::Spec->rel2abs($configFile) . "';\n";
+    print $configHandle "\$resyncRatio = $resyncRatio;\n";
+    print $configHandle "\$sleepInterval = 1;\n1;\n";
+    close($configHandle);
+
+    my $waitingQuery = "SELECT count(*) FROM (SELECT XID FROM dbmirror_Pending";
+    my $pendingLogResult = $masterConn->exec("SELECT to_regclass(" .
+					     "'dbmirror_PendingLog')");
+    if($pendingLogResult->getvalue(0,0) ne '') {
+	$waitingQuery .= " UNION ALL SELECT XID FROM dbmirror_PendingLog";
+    }
+    $waitingQuery .= ") pd WHERE NOT EXISTS (SELECT 1 FROM";
+    $waitingQuery .= " dbmirror_MirroredTransaction mt, dbmirror_MirrorHost mh";
+    $waitingQuery .= " WHERE mt.XID=pd.XID AND mt.MirrorHostId=mh.MirrorHostId";
+    $waitingQuery .= " AND mh.SlaveName='" . $::slaveInfo->{"slaveName"} . "')";
+
+    my $startTime = time;
+    my $copied = 0;
+    my $pid = fork();
+    die "Can't fork: $!" unless defined $pid;
+    if($pid == 0) {
+	exec($^X,dirname($0) . "/DBMirror.pl",$benchConfigFile);
+	die "Can't run DBMirror.pl: $!";
+    }
+    while(1) {
+	sleep(0.5);
+	my $waitingResult = $masterConn->exec($waitingQuery);
+	unless($waitingResult->resultStatus == PGRES_TUPLES_OK) {
+	    kill('TERM',$pid);
+	    die $masterConn->errorMessage;
+	}
+	#The copy is remembered on the slave until its skipped changes
+	#have been recorded as mirrored, which is after they stop waiting.
+	$copied = 1 if wasCopied();
+	last if $waitingResult->getvalue(0,0) == 0;
+	if(waitpid($pid,WNOHANG) == $pid) {
+	    die "DBMirror.pl exited before the slave caught up\n";
+	}
+    }
+    my $seconds = time - $startTime;
+    kill('TERM',$pid);
+    waitpid($pid,0);
+    return ($seconds,$copied);
+}
+
+
+=item wasCopied()
+
+Returns true if the slave's dbmirror_Resync table has a row for the table,
+ie. DBMirror.pl has copied it.
+
+=cut
+
+sub wasCopied() {
+    my $result = $slaveConn->exec("SELECT 1 FROM dbmirror_Resync WHERE" .
+				  " TableName='\"public\".\"$tableName\"'");
+    unless($result->resultStatus == PGRES_TUPLES_OK) {
+	die $slaveConn->errorMessage;
+    }
+    return $result->ntuples > 0;
+}
+
+
+=item tableHash(conn)
+
+Returns a hash of the contents of the table.
+
+=cut
+
+sub tableHash($) {
+    my $conn = $_[0];
+    my $result = $conn->exec("SELECT md5(string_agg(b::text, ',' ORDER BY id))" .
+			     " FROM $tableName b");
+    unless($result->resultStatus == PGRES_TUPLES_OK) {
+	die $conn->errorMessage;
+    }
+    return $result->getvalue(0,0);
+}
+
+=back
+
+=cut
@@ -0,0 +1,678 @@
+#!/usr/bin/perl
+# check_mirror.pl
+# This perl script compares the contents of the mirrored tables on the
+# master with the contents of the same tables on a slave.
+#
+#
+##############################################################################
+
+
+=head1 NAME
+
+check_mirror.pl - A Perl script to verify that a slave database holds the
+same data as the master.
+
+
+=head1 SYNPOSIS
+
+
+check_mirror.pl slaveConfigfile.conf [tableName ...]
+
+
+=head1 DESCRIPTION
+
+
+This Perl script uses the same configuration file as DBMirror.pl.  It
+connects to the master and to the slave database and compares every table
+that has the recordchange trigger on the master (or only the tables given
+on the command line).
+
+Each table is split into chunks of $checkChunkSize rows by ranges of its
+primary key.  A row count and a hash of the rows in each chunk are computed
+on the master and the slave at the same time.  Only the count and the hash
+are sent back.  Chunks that don't match are split into smaller chunks until
+they contain at most $checkLeafSize rows.  The primary keys and a hash of
+each row in these chunks are then compared to find the differing rows.
+
+Both sessions use the same TimeZone, DateStyle, IntervalStyle,
+extra_float_digits, bytea_output and lc_monetary, so the text of a row
+that is hashed doesn't depend on the settings of either server.
+
+Rows that have changes pending for the slave in the dbmirror_Pending table
+have not been mirrored yet.  Differences in these rows are reported as
+in flight and not as drift.  Differing rows are compared a second time
+before being reported to allow for changes that were mirrored while the
+check was running.
+
+Setting $checkWorkers to more than 1 deals the chunks of each table out to
+that many worker processes, each with its own pair of sessions.  The
+snapshots of the master and the slave sessions that split the table are
+exported with pg_export_snapshot() and imported by every worker, so all
+chunks of a table are compared as of the same two snapshots.
+
+The script exits with a non zero status if any drift was found.
+
+=cut
+
+BEGIN {
+    # add in a global path to files
+    #Ensure that Pg is in the path.
+}
+
+
+use strict;
+use Pg;
+use POSIX ();
+use Storable qw(store_fd fd_retrieve);
+
+sub connectToDatabase($$$$$);
+sub getMirroredTables();
+sub getColumns($);
+sub checkTable($);
+sub checkRange($$$$$$);
+sub checkChunk($$$);
+sub checkChunksInWorkers($$$$);
+sub splitRange($$$$$);
+sub compareRows($$$$$);
+sub rangeCondition($$$);
+sub sendBoth($$);
+sub collectResult($$);
+sub getPendingKeys($$);
+sub parsePendingData($);
+sub quoteLiteral($);
+
+local $::masterHost;
+local $::masterPort;
+local $::masterDb;
+local $::masterUser;
+local $::masterPassword;
+local $::checkChunkSize=100000;
+local $::checkLeafSize=1000;
+local $::checkFanout=16;
+local $::checkWorkers=1;
+
+my %slaveInfoHash;
+local $::slaveInfo = \%slaveInfoHash;
+
+my $masterConn;
+my $slaveConn;
+my $driftCount=0;
+
+if ($#ARGV < 0) {
+    die "usage: check_mirror.pl configFile [tableName ...]\n";
+}
+
+my $configFile = shift @ARGV;
+if( ! defined do $configFile) {
+    die("Invalid Configuration file $configFile");
+}
+unless(defined($::slaveInfo->{"slaveDb"})) {
+    die("check_mirror.pl needs a slaveDb in $configFile\n");
+}
+
+my @tables = @ARGV;
+if($#tables < 0) {
+    $masterConn = connectToDatabase($::masterHost,$::masterPort,$::masterDb,
+				    $::masterUser,$::masterPassword);
+    @tables = getMirroredTables();
+    $masterConn = undef;
+}
+
+$masterConn = connectToDatabase($::masterHost,$::masterPort,$::masterDb,
+				$::masterUser,$::masterPassword);
+$slaveConn = connectToDatabase($::slaveInfo->{"slaveHost"},
+			       $::slaveInfo->{"slavePort"},
+			       $::slaveInfo->{"slaveDb"},
+			       $::slaveInfo->{"slaveUser"},
+			       $::slaveInfo->{"slavePassword"});
+foreach my $tableName (@tables) {
+    checkTable($tableName);
+}
+$masterConn = undef;
+$slaveConn = undef;
+
+exit($driftCount > 0 ? 1 : 0);
+
+
+
+=head1 METHODS
+
+=over 4
+
+=cut
+
+
+sub connectToDatabase($$$$$) {
+    my ($host,$port,$db,$user,$password) = @_;
+    my $connectString;
+    if(defined($host)) {
+	$connectString .= "host=$host ";
+    }
+    if(defined($port)) {
+	$connectString .= "port=$port ";
+    }
+    $connectString .= "dbname=$db user=$user password=$password";
+
+    my $conn = Pg::connectdb($connectString);
+    unless($conn->status == PGRES_CONNECTION_OK) {
+	die "Can't connect to database $db\n" . $conn->errorMessage;
+    }
+
+    #The rows are hashed as text, so both servers have to print values
+    #the same way regardless of their defaults.
+    my $settingsQuery = "SET TimeZone = 'UTC'; SET DateStyle = 'ISO, YMD';";
+    $settingsQuery .= " SET IntervalStyle = 'postgres';";
+    $settingsQuery .= " SET extra_float_digits = 3; SET bytea_output = 'hex';";
+    $settingsQuery .= " SET lc_monetary = 'C'";
+    my $result = $conn->exec($settingsQuery);
+    unless($result->resultStatus == PGRES_COMMAND_OK) {
+	die $conn->errorMessage . "\n" . $settingsQuery;
+    }
+    return $conn;
+}
+
+
+=item getMirroredTables()
+
+Returns the names of all tables on the master that have the recordchange
+trigger.  The names are quoted the same way the trigger stores them in
+dbmirror_Pending.
+
+=cut
+
+sub getMirroredTables() {
+    my $tableQuery = "SELECT DISTINCT '\"' || n.nspname || '\".\"' ||";
+    $tableQuery .= " c.relname || '\"' FROM pg_trigger t, pg_proc p,";
+    $tableQuery .= " pg_class c, pg_namespace n WHERE t.tgfoid = p.oid";
+    $tableQuery .= " AND p.proname = 'recordchange' AND t.tgrelid = c.oid";
+    $tableQuery .= " AND c.relnamespace = n.oid ORDER BY 1";
+
+    my $result = $masterConn->exec($tableQuery);
+    unless($result->resultStatus == PGRES_TUPLES_OK) {
+	die $masterConn->errorMessage;
+    }
+    my @tableNames;
+    for(my $curTuple = 0; $curTuple < $result->ntuples; $curTuple++) {
+	push @tableNames, $result->getvalue($curTuple,0);
+    }
+    return @tableNames;
+}
+
+
+=item getColumns(tableName)
+
+Returns references to the list of primary key columns and the list of
+all columns of a table on the master, in column order.
+
+=cut
+
+sub getColumns($) {
+    my $tableName = $_[0];
+    my $columnQuery = "SELECT a.attname, EXISTS (SELECT 1 FROM pg_index i";
+    $columnQuery .= " WHERE i.indrelid = a.attrelid AND i.indisprimary";
+    $columnQuery .= " AND a.attnum = ANY (i.indkey)) FROM pg_attribute a";
+    $columnQuery .= " WHERE a.attrelid = " . quoteLiteral($tableName);
+    $columnQuery .= "::regclass AND a.attnum > 0 AND NOT a.attisdropped";
+    $columnQuery .= " ORDER BY a.attnum";
+
+    my $result = $masterConn->exec($columnQuery);
+    unless($result->resultStatus == PGRES_TUPLES_OK) {
+	die $masterConn->errorMessage;
+    }
+    my @keyColumns;
+    my @columns;
+    for(my $curTuple = 0; $curTuple < $result->ntuples; $curTuple++) {
+	my $column = '"' . $result->getvalue($curTuple,0) . '"';
+	push @columns, $column;
+	push @keyColumns, $column if $result->getvalue($curTuple,1) eq 't';
+    }
+    return (\@keyColumns,\@columns);
+}
+
+
+=item checkTable(tableName)
+
+Compares a single table between the master and the slave and prints the
+rows that differ.
+
+=cut
+
+sub checkTable($) {
+    my $tableName = $_[0];
+    my ($keyColumns,$columns) = getColumns($tableName);
+    if($#$keyColumns < 0) {
+	print "$tableName: has no primary key, skipped\n";
+	return;
+    }
+
+    my %table = ("name" => $tableName,
+		 "keyColumns" => $keyColumns,
+		 "columns" => $columns,
+		 "differences" => {});
+
+    sendBoth("BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY",
+	     "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+    #The snapshot is taken by the first query of the transaction.  Take it
+    #on both servers at the same time, before the master is busy splitting
+    #the table, and export it for the workers.
+    my ($masterResult,$slaveResult) = sendBoth("SELECT pg_export_snapshot()",
+					       "SELECT pg_export_snapshot()");
+    my @bounds = splitRange(\%table,undef,undef,$::checkChunkSize,undef);
+    if($::checkWorkers > 1 && $#bounds > 1) {
+	checkChunksInWorkers(\%table,\@bounds,$masterResult->getvalue(0,0),
+			     $slaveResult->getvalue(0,0));
+    }
+    else {
+	for(my $chunk = 0; $chunk < $#bounds; $chunk++) {
+	    checkChunk(\%table,$bounds[$chunk],$bounds[$chunk+1]);
+	}
+    }
+    #The exported snapshots are only valid until here.
+    sendBoth("COMMIT","COMMIT");
+
+    my $differences = $table{"differences"};
+    if(scalar(keys %$differences) == 0) {
+	print "$tableName: ok\n";
+	return;
+    }
+
+    #Compare the differing rows again now that the applier has had a chance
+    #to catch up, then ignore the rows that are still waiting to be mirrored.
+    my %recheck;
+    foreach my $identity (keys %$differences) {
+	my $keyValues = $differences->{$identity}->{"keyValues"};
+	my $condition = '(' . join(',',@$keyColumns) . ') = ('
+	    . join(',',map { quoteLiteral($_) } @$keyValues) . ')';
+	my ($masterRows,$slaveRows) = compareRows(\%table,$condition,
+						  undef,undef,1);
+	foreach my $row (keys %$masterRows, keys %$slaveRows) {
+	    $recheck{$row} = $differences->{$row} if exists $differences->{$row};
+	}
+    }
+    my $pendingKeys = getPendingKeys($tableName,$keyColumns);
+
+    foreach my $identity (sort keys %recheck) {
+	my $difference = $recheck{$identity};
+	my $keyText = join(',',@{$difference->{"keyValues"}});
+	if(exists $pendingKeys->{$identity}) {
+	    print "$tableName: ($keyText) in flight\n";
+	}
+	else {
+	    print "$tableName: ($keyText) " . $difference->{"problem"} . "\n";
+	    $driftCount++;
+	}
+    }
+    print "$tableName: checked\n";
+}
+
+
+=item checkRange(table,lower,upper,masterCount,slaveCount,step)
+
+Compares the rows of a table with a primary key of at least lower and less
+than upper.  An undefined bound is open.  The range is split into chunks of
+about step rows on the master, the chunks are hashed on the master and
+the slave and any chunks that differ are checked again with a smaller step.
+
+=cut
+
+sub checkRange($$$$$$) {
+    my ($table,$lower,$upper,$masterCount,$slaveCount,$step) = @_;
+
+    if(defined($masterCount) && $masterCount <= $::checkLeafSize &&
+       $slaveCount <= $::checkLeafSize) {
+	compareRows($table,rangeCondition($table,$lower,$upper),
+		    $lower,$upper,0);
+	return;
+    }
+
+    my @bounds = splitRange($table,$lower,$upper,$step,$masterCount);
+    if(defined($masterCount) && $#bounds < 2) {
+	#The range can't be split any further (ie. the rows
+	#are all on the slave).
+	compareRows($table,rangeCondition($table,$lower,$upper),
+		    $lower,$upper,0);
+	return;
+    }
+
+    for(my $chunk = 0; $chunk < $#bounds; $chunk++) {
+	checkChunk($table,$bounds[$chunk],$bounds[$chunk+1]);
+    }
+}
+
+
+=item checkChunk(table,lower,upper)
+
+Hashes the rows of a table with a primary key of at least lower and less
+than upper on the master and the slave and checks the chunk again in
+smaller chunks if the hashes differ.
+
+=cut
+
+sub checkChunk($$$) {
+    my ($table,$lower,$upper) = @_;
+    my $rowHash = "('x' || substr(md5(ROW(" . join(',',@{$table->{"columns"}})
+	. ")::text),1,16))::bit(64)::bigint";
+
+    my $hashQuery = "SELECT count(*), coalesce(sum($rowHash),0) FROM "
+	. $table->{"name"} . " WHERE " . rangeCondition($table,$lower,$upper);
+    my ($masterResult,$slaveResult) = sendBoth($hashQuery,$hashQuery);
+
+    my $masterCount = $masterResult->getvalue(0,0);
+    my $slaveCount = $slaveResult->getvalue(0,0);
+    if($masterCount == $slaveCount &&
+       $masterResult->getvalue(0,1) eq $slaveResult->getvalue(0,1)) {
+	return;
+    }
+    my $subStep = int(($masterCount + $::checkFanout - 1) / $::checkFanout);
+    $subStep = $::checkLeafSize if $subStep < $::checkLeafSize;
+    checkRange($table,$lower,$upper,$masterCount,$slaveCount,$subStep);
+}
+
+
+=item checkChunksInWorkers(table,bounds,masterSnapshot,slaveSnapshot)
+
+Deals the chunks between bounds out to $checkWorkers forked worker
+processes.  Each worker opens its own sessions, imports the snapshots
+exported by the master and the slave sessions and checks its chunks with
+checkChunk.  The differences found by the workers are added to the
+table's differences.
+
+=cut
+
+sub checkChunksInWorkers($$$$) {
+    my ($table,$bounds,$masterSnapshot,$slaveSnapshot) = @_;
+    my @workers;
+
+    for(my $worker = 0; $worker < $::checkWorkers; $worker++) {
+	my ($reader,$writer);
+	pipe($reader,$writer) or die "Can't create pipe: $!";
+	my $pid = fork();
+	die "Can't fork: $!" unless defined $pid;
+	if($pid != 0) {
+	    close($writer);
+	    push @workers, [$pid,$reader];
+	    next;
+	}
+
+	#The connections of the parent are shared with it.  Keep them
+	#referenced and leave with POSIX::_exit so they aren't closed.
+	my @parentConns = ($masterConn,$slaveConn);
+	close($reader);
+	eval {
+	    $masterConn = connectToDatabase($::masterHost,$::masterPort,
+					    $::masterDb,$::masterUser,
+					    $::masterPassword);
+	    $slaveConn = connectToDatabase($::slaveInfo->{"slaveHost"},
+					   $::slaveInfo->{"slavePort"},
+					   $::slaveInfo->{"slaveDb"},
+					   $::slaveInfo->{"slaveUser"},
+					   $::slaveInfo->{"slavePassword"});
+	    sendBoth("BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY",
+		     "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY");
+	    sendBoth("SET TRANSACTION SNAPSHOT " . quoteLiteral($masterSnapshot),
+		     "SET TRANSACTION SNAPSHOT " . quoteLiteral($slaveSnapshot));
+	    for(my $chunk = $worker; $chunk < $#$bounds;
+		$chunk += $::checkWorkers) {
+		checkChunk($table,$bounds->[$chunk],$bounds->[$chunk+1]);
+	    }
+	    sendBoth("COMMIT","COMMIT");
+	    store_fd($table->{"differences"},$writer);
+	    close($writer) or die "Can't write to pipe: $!";
+	};
+	if($@) {
+	    print STDERR $@;
+	    POSIX::_exit(2);
+	}
+	POSIX::_exit(0);
+    }
+
+    my $failed = 0;
+    foreach my $workerInfo (@workers) {
+	my ($pid,$reader) = @$workerInfo;
+	my $workerDifferences = eval { fd_retrieve($reader) };
+	close($reader);
+	waitpid($pid,0);
+	if($? != 0 || !defined $workerDifferences) {
+	    $failed = 1;
+	    next;
+	}
+	foreach my $identity (keys %$workerDifferences) {
+	    $table->{"differences"}->{$identity} =
+		$workerDifferences->{$identity};
+	}
+    }
+    die "A worker checking " . $table->{"name"} . " failed\n" if $failed;
+}
+
+
+=item splitRange(table,lower,upper,step,rowCount)
+
+Returns the bounds of the chunks the range lower to upper is split into.
+Every step'th primary key on the master becomes a bound.  The first and last
+bounds are lower and upper so that rows that only exist on the slave are
+still covered.
+
+=cut
+
+sub splitRange($$$$$) {
+    my ($table,$lower,$upper,$step,$rowCount) = @_;
+    my $keyList = join(',',@{$table->{"keyColumns"}});
+
+    if(defined($rowCount) && $rowCount <= $step) {
+	return ($lower,$upper);
+    }
+
+    my $boundQuery = "SELECT $keyList FROM (SELECT $keyList,";
+    $boundQuery .= " row_number() OVER (ORDER BY $keyList) AS dbmirror_rn";
+    $boundQuery .= " FROM " . $table->{"name"} . " WHERE ";
+    $boundQuery .= rangeCondition($table,$lower,$upper);
+    $boundQuery .= ") s WHERE dbmirror_rn % $step = 1 AND dbmirror_rn > 1";
+    $boundQuery .= " ORDER BY dbmirror_rn";
+
+    my $result = $masterConn->exec($boundQuery);
+    unless($result->resultStatus == PGRES_TUPLES_OK) {
+	die $masterConn->errorMessage . "\n" . $boundQuery;
+    }
+    my @bounds = ($lower);
+    for(my $curTuple = 0; $curTuple < $result->ntuples; $curTuple++) {
+	my @keyValues;
+	for(my $field = 0; $field < $result->nfields; $field++) {
+	    push @keyValues, $result->getvalue($curTuple,$field);
+	}
+	push @bounds, \@keyValues;
+    }
+    push @bounds, $upper;
+    return @bounds;
+}
+
+
+=item compareRows(table,condition,lower,upper,quiet)
+
+Fetches the primary key and a hash of every row matching condition from the
+master and the slave and records the rows that differ in the table's
+differences.  Returns references to the hashes of the differing rows seen
+on the master and on the slave.
+
+=cut
+
+sub compareRows($$$$$) {
+    my ($table,$condition,$lower,$upper,$quiet) = @_;
+    my @keyColumns = @{$table->{"keyColumns"}};
+    my $rowQuery = "SELECT md5(ROW(" . join(',',@{$table->{"columns"}});
+    $rowQuery .= ")::text), " . join(',',@keyColumns) . " FROM ";
+    $rowQuery .= $table->{"name"} . " WHERE $condition";
+
+    my @results = sendBoth($rowQuery,$rowQuery);
+    my @rowHashes = ({},{});
+    my %keyValues;
+    for(my $side = 0; $side < 2; $side++) {
+	my $result = $results[$side];
+	for(my $curTuple = 0; $curTuple < $result->ntuples; $curTuple++) {
+	    my @values;
+	    for(my $field = 1; $field <= $#keyColumns + 1; $field++) {
+		push @values, $result->getvalue($curTuple,$field);
+	    }
+	    my $identity = join("\0",@values);
+	    $rowHashes[$side]->{$identity} = $result->getvalue($curTuple,0);
+	    $keyValues{$identity} = \@values;
+	}
+    }
+
+    my ($masterRows,$slaveRows) = @rowHashes;
+    my %masterDiffers;
+    my %slaveDiffers;
+    foreach my $identity (keys %keyValues) {
+	my $problem;
+	if(!exists $slaveRows->{$identity}) {
+	    $problem = "missing on slave";
+	}
+	elsif(!exists $masterRows->{$identity}) {
+	    $problem = "extra on slave";
+	}
+	elsif($masterRows->{$identity} ne $slaveRows->{$identity}) {
+	    $problem = "differs";
+	}
+	else {
+	    next;
+	}
+	$masterDiffers{$identity} = 1 if exists $masterRows->{$identity};
+	$slaveDiffers{$identity} = 1 if exists $slaveRows->{$identity};
+	unless($quiet) {
+	    $table->{"differences"}->{$identity} =
+		{"keyValues" => $keyValues{$identity}, "problem" => $problem};
+	}
+    }
+    return (\%masterDiffers,\%slaveDiffers);
+}
+
+
+sub rangeCondition($$$) {
+    my ($table,$lower,$upper) = @_;
+    my $keyList = '(' . join(',',@{$table->{"keyColumns"}}) . ')';
+    my @conditions = ('true');
+    if(defined $lower) {
+	push @conditions, "$keyList >= ("
+	    . join(',',map { quoteLiteral($_) } @$lower) . ')';
+    }
+    if(defined $upper) {
+	push @conditions, "$keyList < ("
+	    . join(',',map { quoteLiteral($_) } @$upper) . ')';
+    }
+    return join(' AND ',@conditions);
+}
+
+
+=item sendBoth(masterQuery,slaveQuery)
+
+Runs masterQuery on the master and slaveQuery on the slave at the same time
+and returns both results.
+
+=cut
+
+sub sendBoth($$) {
+    my ($masterQuery,$slaveQuery) = @_;
+    unless($masterConn->sendQuery($masterQuery)) {
+	die $masterConn->errorMessage . "\n" . $masterQuery;
+    }
+    unless($slaveConn->sendQuery($slaveQuery)) {
+	die $slaveConn->errorMessage . "\n" . $slaveQuery;
+    }
+    return (collectResult($masterConn,$masterQuery),
+	    collectResult($slaveConn,$slaveQuery));
+}
+
+sub collectResult($$) {
+    my ($conn,$query) = @_;
+    my $result = $conn->getResult;
+    while(defined($conn->getResult)) {
+    }
+    unless(defined($result) &&
+	   ($result->resultStatus == PGRES_TUPLES_OK ||
+	    $result->resultStatus == PGRES_COMMAND_OK)) {
+	die $conn->errorMessage . "\n" . $query;
+    }
+    return $result;
+}
+
+
+=item getPendingKeys(tableName,keyColumns)
+
+Returns a hash of the primary keys of the rows of tableName that have
+changes in dbmirror_Pending that have not been mirrored to the slave yet.
+Both the key before and after each change are included.
+
+=cut
+
+sub getPendingKeys($$) {
+    my ($tableName,$keyColumns) = @_;
+    my $slaveName = quoteLiteral($::slaveInfo->{"slaveName"});
+    my $pendingQuery = "SELECT pnddata.Data FROM dbmirror_Pending pnd,";
+    $pendingQuery .= " dbmirror_PendingData pnddata WHERE";
+    $pendingQuery .= " pnd.SeqId = pnddata.SeqId AND pnd.TableName = ";
+    $pendingQuery .= quoteLiteral($tableName) . " AND NOT EXISTS (SELECT 1";
+    $pendingQuery .= " FROM dbmirror_MirroredTransaction mt,";
+    $pendingQuery .= " dbmirror_MirrorHost mh WHERE mt.XID = pnd.XID AND";
+    $pendingQuery .= " mt.MirrorHostId = mh.MirrorHostId AND";
+    $pendingQuery .= " mh.SlaveName = $slaveName)";
+
+    my $logResult = $masterConn->exec("SELECT to_regclass('dbmirror_PendingLog')");
+    if($logResult->resultStatus == PGRES_TUPLES_OK &&
+       $logResult->getvalue(0,0) ne '') {
+	#Both the key data and the data of the single table layout.
+	my $logQuery = " FROM dbmirror_PendingLog pnd WHERE pnd.TableName = ";
+	$logQuery .= quoteLiteral($tableName) . " AND NOT EXISTS (SELECT 1";
+	$logQuery .= " FROM dbmirror_MirroredTransaction mt,";
+	$logQuery .= " dbmirror_MirrorHost mh WHERE mt.XID = pnd.XID AND";
+	$logQuery .= " mt.MirrorHostId = mh.MirrorHostId AND";
+	$logQuery .= " mh.SlaveName = $slaveName)";
+	$pendingQuery .= " UNION ALL SELECT pnd.KeyData $logQuery";
+	$pendingQuery .= " UNION ALL SELECT pnd.Data $logQuery";
+    }
+
+    my $result = $masterConn->exec($pendingQuery);
+    unless($result->resultStatus == PGRES_TUPLES_OK) {
+	die $masterConn->errorMessage . "\n" . $pendingQuery;
+    }
+    my %pendingKeys;
+    for(my $curTuple = 0; $curTuple < $result->ntuples; $curTuple++) {
+	next if $result->getisnull($curTuple,0);
+	my %values = parsePendingData($result->getvalue($curTuple,0));
+	my @keyValues;
+	foreach my $column (@$keyColumns) {
+	    my $field = $column;
+	    $field =~ s/^"(.*)"$/$1/;
+	    push @keyValues, $values{$field};
+	}
+	$pendingKeys{join("\0",@keyValues)} = 1;
+    }
+    return \%pendingKeys;
+}
+
+
+=item parsePendingData(data)
+
+Splits a dbmirror_PendingData Data value of the form "field"='value' into a
+hash of field names and values.  References to dbmirror_LargeValue are
+returned as they are.
+
+=cut
+
+sub parsePendingData($) {
+    my $data = $_[0];
+    my %values;
+    while($data =~ m/\G"(.*?)"=(?: |'((?:[^'\\]|''|\\.)*)' |(#[bt][0-9a-f]+) )/gs) {
+	my $fieldName = $1;
+	#Large values are only referred to by their hash.
+	my $value = defined($3) ? $3 : $2;
+	$value =~ s/(['\\])\1/$1/g if defined $value;
+	$values{$fieldName} = $value;
+    }
+    return %values;
+}
+
+
+sub quoteLiteral($) {
+    my $value = $_[0];
+    $value =~ s/'/''/g;
+    return "'$value'";
+}
@@ -1,7 +1,8 @@
 #!/usr/bin/perl
 # clean_pending.pl
 # This perl script removes entries from the pending,pendingKeys,
-# pendingDeleteData tables that have already been mirrored to all hosts.
+# pendingDeleteData and pendingLog tables that have already been mirrored
+# to all hosts.
 #
 #
 #
@@ -83,6 +84,60 @@ unless ($result->resultStatus == PGRES_COMMAND_OK ) {
     printf($dbConn->errorMessage);
     die;
 }
+
+#The single table layout keeps its changes in dbmirror_PendingLog.
+#Its rows are not referenced by dbmirror_MirroredTransaction so those
+#have to be removed once none of the changes of the transaction are left.
+$result = $dbConn->exec("SELECT to_regclass('dbmirror_PendingLog')");
+my $hasPendingLog = $result->resultStatus == PGRES_TUPLES_OK &&
+    $result->getvalue(0,0) ne '';
+if($hasPendingLog) {
+    my $deleteLogQuery = $deletePendingQuery;
+    $deleteLogQuery =~ s/dbmirror_Pending\b/dbmirror_PendingLog/g;
+    $result = $dbConn->exec($deleteLogQuery);
+    unless ($result->resultStatus == PGRES_COMMAND_OK ) {
+	printf($dbConn->errorMessage);
+	die;
+    }
+
+    my $deleteMirroredQuery = 'DELETE FROM dbmirror_MirroredTransaction mt';
+    $deleteMirroredQuery .= ' WHERE NOT EXISTS (SELECT 1 FROM dbmirror_Pending';
+    $deleteMirroredQuery .= ' WHERE XID=mt.XID) AND NOT EXISTS (SELECT 1 FROM';
+    $deleteMirroredQuery .= ' dbmirror_PendingLog WHERE XID=mt.XID)';
+    $result = $dbConn->exec($deleteMirroredQuery);
+    unless ($result->resultStatus == PGRES_COMMAND_OK ) {
+	printf($dbConn->errorMessage);
+	die;
+    }
+}
+
+#Delete the large values that no pending change refers to anymore.
+#The lock waits for the transactions that are storing large values and
+#keeps new ones out until the delete is committed, so a value that was
+#just reused by another change is never deleted.
+$result = $dbConn->exec("SELECT to_regclass('dbmirror_LargeValue')");
+if($result->resultStatus == PGRES_TUPLES_OK && $result->getvalue(0,0) ne '') {
+    $result = $dbConn->exec('LOCK TABLE dbmirror_LargeValue IN EXCLUSIVE MODE');
+    unless ($result->resultStatus == PGRES_COMMAND_OK ) {
+	printf($dbConn->errorMessage);
+	die;
+    }
+    #NOT EXISTS lets the planner use a hashed anti join.  NOT IN can end
+    #up rescanning the referenced hashes for every large value.
+    my $deleteQuery = "WITH Referenced AS (SELECT (regexp_matches(Data,";
+    $deleteQuery .= " '=#[bt]([0-9a-f]+) ', 'g'))[1] AS Hash FROM dbmirror_PendingData";
+    if($hasPendingLog) {
+	$deleteQuery .= " UNION ALL SELECT (regexp_matches(Data,";
+	$deleteQuery .= " '=#[bt]([0-9a-f]+) ', 'g'))[1] FROM dbmirror_PendingLog";
+    }
+    $deleteQuery .= ") DELETE FROM dbmirror_LargeValue lv WHERE NOT EXISTS";
+    $deleteQuery .= " (SELECT 1 FROM Referenced r WHERE r.Hash = lv.Hash)";
+    $result = $dbConn->exec($deleteQuery);
+    unless ($result->resultStatus == PGRES_COMMAND_OK ) {
+	printf($dbConn->errorMessage);
+	die;
+    }
+}
 $dbConn->exec("COMMIT");
 $result = $dbConn->exec('VACUUM dbmirror_Pending');
 unless ($result->resultStatus == PGRES_COMMAND_OK) {
@@ -92,6 +147,19 @@ $result = $dbConn->exec('VACUUM dbmirror_PendingData');
 unless($result->resultStatus == PGRES_COMMAND_OK) {
    printf($dbConn->errorMessage);
 }
+if($hasPendingLog) {
+    $result = $dbConn->exec('VACUUM dbmirror_PendingLog');
+    unless($result->resultStatus == PGRES_COMMAND_OK) {
+	printf($dbConn->errorMessage);
+    }
+}
+$result = $dbConn->exec("SELECT to_regclass('dbmirror_LargeValue')");
+if($result->resultStatus == PGRES_TUPLES_OK && $result->getvalue(0,0) ne '') {
+    $result = $dbConn->exec('VACUUM dbmirror_LargeValue');
+    unless($result->resultStatus == PGRES_COMMAND_OK) {
+	printf($dbConn->errorMessage);
+    }
+}
 $result = $dbConn->exec('VACUUM dbmirror_MirroredTransaction');
 unless($result->resultStatus == PGRES_COMMAND_OK) {
   printf($dbConn->errorMessage);
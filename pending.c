@@ -39,6 +39,8 @@
 #include "utils/lsyscache.h"
 #include "utils/array.h"
 #include "utils/rel.h"
+#include "utils/guc.h"
+#include "catalog/namespace.h"
 #include "catalog/pg_type.h"
 #include "access/xact.h"
 
@@ -58,6 +60,21 @@
 
 PG_MODULE_MAGIC;
 
+/*
+ * When set changes are written as a single row to dbmirror_PendingLog
+ * instead of to dbmirror_Pending and dbmirror_PendingData.
+ */
+static bool usePendingLog = false;
+
+/*
+ * Values of bytea, text and varchar columns larger than this many bytes are
+ * stored once in dbmirror_LargeValue and referenced by their hash.
+ * 0 disables this.
+ */
+static int	largeValueThreshold = 0;
+
+void		_PG_init(void);
+
 enum FieldUsage
 {
 	PRIMARY = 0, NONPRIMARY, ALLKEYS, ALL, NUM_FIELDUSAGE
@@ -72,6 +89,13 @@ int storePending(char *cpTableName, HeapTuple tBeforeTuple,
 
 
 
+int storePendingLog(char *cpTableName, HeapTuple tBeforeTuple,
+			 HeapTuple tAfterTuple,
+			 TupleDesc tTupdesc,
+			 Oid tableOid,
+			 char cOp,
+			 bool verbose);
+
 int storeKeyInfo(char *cpTableName, HeapTuple tTupleData, TupleDesc tTuplDesc,
 			 Oid tableOid);
 int storeData(char *cpTableName, HeapTuple tTupleData,
@@ -83,9 +107,14 @@ ArrayType  *getForeignKey(Oid tblOid);
 char *packageData(HeapTuple tTupleData, TupleDesc tTupleDecs, Oid tableOid,
 			enum FieldUsage eKeyUsage);
 
+char *packageLargeValue(HeapTuple tTupleData, TupleDesc tTupleDesc,
+			int iColumn);
+
 
 #define BUFFER_SIZE 256
 #define MAX_OID_LEN 10
+#define LARGE_VALUE_CHUNK_SIZE 262144
+#define LARGE_VALUE_REF_LEN 66
 
 /*#define DEBUG_OUTPUT 1 */
 
@@ -113,6 +142,39 @@ extern Datum nextval_mirror(PG_FUNCTION_ARGS);
 static void saveSequenceUpdate(Oid relid, int64 nextValue, bool iscalled);
 
 
+/*****************************************************************************
+ * Module load callback.  Defines the dbmirror.pending_log setting which
+ * selects the layout of the pending tables.
+ ****************************************************************************/
+void
+_PG_init(void)
+{
+	DefineCustomBoolVariable("dbmirror.pending_log",
+							 "Record changes in the single dbmirror_PendingLog table.",
+							 NULL,
+							 &usePendingLog,
+							 false,
+							 PGC_USERSET,
+							 0,
+							 NULL,
+							 NULL,
+							 NULL);
+
+	DefineCustomIntVariable("dbmirror.large_value_threshold",
+							"Store values larger than this in dbmirror_LargeValue.",
+							NULL,
+							&largeValueThreshold,
+							0,
+							0,
+							PG_INT32_MAX,
+							PGC_USERSET,
+							GUC_UNIT_BYTE,
+							NULL,
+							NULL,
+							NULL);
+}
+
+
 /*****************************************************************************
  * The entry point for the trigger function.
  * The Trigger takes a single SQL 'text' argument indicating the name of the
@@ -201,8 +263,11 @@ recordchange(PG_FUNCTION_ARGS)
 						 errmsg("dbmirror:recordchange Unknown operation")));
 		}
 
-		if (storePending(fullyqualtblname, beforeTuple, afterTuple,
-						 tupdesc, retTuple->t_tableOid, op, verbose))
+		if ((usePendingLog ?
+			 storePendingLog(fullyqualtblname, beforeTuple, afterTuple,
+							 tupdesc, retTuple->t_tableOid, op, verbose) :
+			 storePending(fullyqualtblname, beforeTuple, afterTuple,
+						  tupdesc, retTuple->t_tableOid, op, verbose)))
 		{
 			/* An error occoured. Skip the operation. */
 			ereport(ERROR,
@@ -305,6 +370,84 @@ storePending(char *cpTableName, HeapTuple tBeforeTuple,
 
 }
 
+/*****************************************************************************
+ * Writes a record of this tuple change to the pending log table.  The key
+ * data and the row data are stored in the same row so a change costs a
+ * single INSERT.
+ *****************************************************************************/
+int
+storePendingLog(char *cpTableName, HeapTuple tBeforeTuple,
+				HeapTuple tAfterTuple,
+				TupleDesc tTupDesc,
+				Oid tableOid,
+				char cOp,
+				bool verbose)
+{
+	void	   *vpPlan;
+	int			iResult;
+	char	   *cpKeyData = NULL;
+	char	   *cpData = NULL;
+	char		nulls[5] = "     ";
+
+	Datum		saPlanData[5];
+	Oid			taPlanArgTypes[5] = {NAMEOID, CHAROID, INT4OID,
+	VARCHAROID, VARCHAROID};
+	char	   *cpQueryBase =
+	"INSERT INTO dbmirror_PendingLog (TableName,Op,XID,KeyData,Data) " \
+	"VALUES ($1,$2,$3,$4,$5)";
+
+	vpPlan = SPI_prepare(cpQueryBase, 5, taPlanArgTypes);
+	if (vpPlan == NULL)
+		ereport(ERROR, (errcode(ERRCODE_TRIGGERED_ACTION_EXCEPTION),
+						errmsg("dbmirror:storePendingLog error creating plan")));
+
+	if (cOp == 'd' || cOp == 'u')
+	{
+		/**
+		 * Deletes and updates identify the row by its key data, or
+		 * all key data, functions of the verbose parameter.
+		 */
+		cpKeyData = packageData(tBeforeTuple, tTupDesc, tableOid,
+								verbose == TRUE ? ALLKEYS : PRIMARY);
+		if (cpKeyData == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_UNDEFINED_OBJECT),
+			/* cpTableName already contains quotes... */
+					 errmsg("there is no PRIMARY KEY for table %s",
+							cpTableName)));
+	}
+	if (cOp == 'i' || cOp == 'u')
+		cpData = packageData(tAfterTuple, tTupDesc, tableOid, ALL);
+
+	saPlanData[0] = PointerGetDatum(cpTableName);
+	saPlanData[1] = CharGetDatum(cOp);
+	saPlanData[2] = Int32GetDatum(GetCurrentTransactionId());
+	saPlanData[3] = PointerGetDatum(cpKeyData);
+	saPlanData[4] = PointerGetDatum(cpData);
+	if (cpKeyData == NULL)
+		nulls[3] = 'n';
+	if (cpData == NULL)
+		nulls[4] = 'n';
+
+	iResult = SPI_execp(vpPlan, saPlanData, nulls, 1);
+
+	if (cpKeyData != NULL)
+		SPI_pfree(cpKeyData);
+	if (cpData != NULL)
+		SPI_pfree(cpData);
+
+	if (iResult != SPI_OK_INSERT)
+	{
+		elog(NOTICE, "storePendingLog fired (%s) returned %d",
+			 cpQueryBase, iResult);
+		return -1;
+	}
+
+	debug_msg("dbmirror:storePendingLog row successfully stored in pending log");
+
+	return 0;
+}
+
 int
 storeKeyInfo(char *cpTableName, HeapTuple tTupleData,
 			 TupleDesc tTupleDesc, Oid tableOid)
@@ -598,6 +741,31 @@ packageData(HeapTuple tTupleData, TupleDesc tTupleDesc, Oid tableOid,
 		}
 		sprintf(cpDataBlock + iUsedDataBlock, "\"%s\"=", cpFieldName);
 		iUsedDataBlock = iUsedDataBlock + strlen(cpFieldName) + 3;
+
+		if (eKeyUsage == ALL && largeValueThreshold > 0)
+		{
+			/**
+			 * Large values are replaced by a reference to their copy in
+			 * dbmirror_LargeValue.  Key data is always stored inline.
+			 */
+			char	   *cpLargeValueRef;
+
+			cpLargeValueRef = packageLargeValue(tTupleData, tTupleDesc,
+												iColumnCounter);
+			if (cpLargeValueRef != NULL)
+			{
+				while (iDataBlockSize - iUsedDataBlock < LARGE_VALUE_REF_LEN + 2)
+				{
+					cpDataBlock = SPI_repalloc(cpDataBlock, iDataBlockSize + BUFFER_SIZE);
+					iDataBlockSize = iDataBlockSize + BUFFER_SIZE;
+				}
+				sprintf(cpDataBlock + iUsedDataBlock, "%s ", cpLargeValueRef);
+				iUsedDataBlock = iUsedDataBlock + strlen(cpLargeValueRef) + 1;
+				SPI_pfree(cpLargeValueRef);
+				continue;
+			}
+		}
+
 		cpFieldData = SPI_getvalue(tTupleData, tTupleDesc,
 								   iColumnCounter);
 
@@ -679,6 +847,104 @@ packageData(HeapTuple tTupleData, TupleDesc tTupleDesc, Oid tableOid,
 }
 
 
+/**
+ * Stores the value of column iColumn of tTupleData in dbmirror_LargeValue
+ * if it is a bytea, text or varchar value larger than
+ * dbmirror.large_value_threshold bytes.
+ *
+ * The value is split into chunks of LARGE_VALUE_CHUNK_SIZE bytes and keyed
+ * by the SHA-256 hash of its contents.  A value that is already stored
+ * (ie. an unchanged column of an updated row) is not stored again.
+ *
+ * Returns a reference of the form #b<hash> for bytea values or #t<hash> for
+ * text values, or NULL if the value should be stored inline.  Values are
+ * stored inline, with a warning, if dbmirror_LargeValue doesn't exist (ie.
+ * on a master that was set up before large values were supported).
+ */
+char *
+packageLargeValue(HeapTuple tTupleData, TupleDesc tTupleDesc, int iColumn)
+{
+	Oid			typeOid;
+	Datum		value;
+	bool		isNull;
+	struct varlena *vpValue;
+	void	   *pplan;
+	char	   *cpHash;
+	char	   *cpRef;
+	int			iRetCode;
+
+	Datum		planData[1];
+	Oid			planArgTypes[1] = {BYTEAOID};
+	char	   *insQuery =
+	"WITH v AS (SELECT encode(sha256($1),'hex') AS Hash), " \
+	"s AS (INSERT INTO dbmirror_LargeValue (Hash,ChunkNo,Data) " \
+	"SELECT v.Hash, n, substring($1 FROM n * " \
+	CppAsString2(LARGE_VALUE_CHUNK_SIZE) " + 1 FOR " \
+	CppAsString2(LARGE_VALUE_CHUNK_SIZE) ") " \
+	"FROM v, generate_series(0, (length($1) - 1) / " \
+	CppAsString2(LARGE_VALUE_CHUNK_SIZE) ") n " \
+	"WHERE NOT EXISTS (SELECT 1 FROM dbmirror_LargeValue l " \
+	"WHERE l.Hash = v.Hash) ON CONFLICT DO NOTHING) " \
+	"SELECT Hash FROM v";
+
+	typeOid = SPI_gettypeid(tTupleDesc, iColumn);
+	if (typeOid != BYTEAOID && typeOid != TEXTOID && typeOid != VARCHAROID)
+		return NULL;
+
+	value = SPI_getbinval(tTupleData, tTupleDesc, iColumn, &isNull);
+	if (isNull)
+		return NULL;
+
+	vpValue = PG_DETOAST_DATUM(value);
+	if (VARSIZE(vpValue) - VARHDRSZ <= largeValueThreshold)
+		return NULL;
+
+	if (!OidIsValid(RelnameGetRelid("dbmirror_largevalue")))
+	{
+		static bool warned = false;
+
+		if (!warned)
+			ereport(WARNING,
+					(errcode(ERRCODE_UNDEFINED_TABLE),
+					 errmsg("dbmirror.large_value_threshold is set but dbmirror_LargeValue does not exist"),
+					 errdetail("Large values are stored in the change records instead."),
+					 errhint("Run MirrorUpgradeLargeValue.sql on the master or reset dbmirror.large_value_threshold.")));
+		warned = true;
+		return NULL;
+	}
+
+	pplan = SPI_prepare(insQuery, 1, planArgTypes);
+	if (pplan == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_TRIGGERED_ACTION_EXCEPTION),
+				 errmsg("dbmirror:packageLargeValue error creating plan")));
+
+	/*
+	 * text and varchar have the same representation as bytea so the
+	 * value's bytes are stored as they are.
+	 */
+	planData[0] = PointerGetDatum(vpValue);
+	iRetCode = SPI_execp(pplan, planData, NULL, 0);
+	if (iRetCode != SPI_OK_SELECT || SPI_processed != 1)
+		ereport(ERROR,
+				(errcode(ERRCODE_TRIGGERED_ACTION_EXCEPTION),
+				 errmsg("error inserting row in dbmirror_LargeValue")));
+
+	cpHash = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+	cpRef = SPI_palloc(LARGE_VALUE_REF_LEN + 1);
+	snprintf(cpRef, LARGE_VALUE_REF_LEN + 1, "#%c%s",
+			 typeOid == BYTEAOID ? 'b' : 't', cpHash);
+
+	debug_msg2("dbmirror:packageLargeValue stored %s", cpRef);
+
+	SPI_pfree(cpHash);
+	SPI_freeplan(pplan);
+
+	return cpRef;
+}
+
+
 /*
  * Support for mirroring sequence objects.
  */
@@ -757,11 +1023,44 @@ saveSequenceUpdate(Oid relid, int64 nextValue, bool iscalled)
 	"INSERT INTO dbmirror_PendingData(SeqId,IsKey,Data) " \
 	"VALUES (currval('dbmirror_pending_seqid_seq'),'t',$1)";
 
+	Datum		insertLogDatum[3];
+	Oid			insertLogArgTypes[3] = {NAMEOID, INT4OID, NAMEOID};
+	const char *insertLogQuery =
+	"INSERT INTO dbmirror_PendingLog (TableName,Op,XID,KeyData) " \
+	"VALUES ($1,'s',$2,$3)";
+
 	if (SPI_connect() < 0)
 		ereport(ERROR,
 				(errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
 			errmsg("dbmirror:savesequenceupdate could not connect to SPI")));
 
+	snprintf(nextSequenceText, sizeof(nextSequenceText),
+			 INT64_FORMAT ",'%c'",
+			 nextValue, iscalled ? 't' : 'f');
+
+	if (usePendingLog)
+	{
+		insertPlan = SPI_prepare(insertLogQuery, 3, insertLogArgTypes);
+		if (insertPlan == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+				 errmsg("dbmirror:savesequenceupdate error creating plan")));
+
+		insertLogDatum[0] = PointerGetDatum(get_rel_name(relid));
+		insertLogDatum[1] = Int32GetDatum(GetCurrentTransactionId());
+		/* Same type cheat as below. */
+		insertLogDatum[2] = PointerGetDatum(nextSequenceText);
+
+		if (SPI_execp(insertPlan, insertLogDatum, NULL, 1) != SPI_OK_INSERT)
+			ereport(ERROR,
+					(errcode(ERRCODE_EXTERNAL_ROUTINE_EXCEPTION),
+					 errmsg("error inserting row in dbmirror_PendingLog")));
+
+		SPI_pfree(insertPlan);
+		SPI_finish();
+		return;
+	}
+
 	insertPlan = SPI_prepare(insertQuery, 2, insertArgTypes);
 	insertDataPlan = SPI_prepare(insertDataQuery, 1, insertDataArgTypes);
 
@@ -773,10 +1072,6 @@ saveSequenceUpdate(Oid relid, int64 nextValue, bool iscalled)
 	insertDatum[0] = PointerGetDatum(get_rel_name(relid));
 	insertDatum[1] = Int32GetDatum(GetCurrentTransactionId());
 
-	snprintf(nextSequenceText, sizeof(nextSequenceText),
-			 INT64_FORMAT ",'%c'",
-			 nextValue, iscalled ? 't' : 'f');
-
 	/*
 	 * note type cheat here: we prepare a C string and then claim it is a
 	 * NAME, which the system will coerce to varchar for us.